@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poppler-document.h>
+#include <poppler-page-renderer.h>
+#include <poppler-page.h>
+
+#include <X11/Xlib.h>
+
+#include "pixconv.hpp"
+#include "render.hpp"
+#include "trace.hpp"
+#include "upload.hpp"
+
+static bool error(const std::string &m) {
+  throw std::runtime_error(m);
+  return false;
+}
+
+using Clock = std::chrono::steady_clock;
+
+static double since(Clock::time_point start) {
+  std::chrono::duration<double, std::milli> d = Clock::now() - start;
+  return d.count();
+}
+
+struct Stage {
+  std::string name;
+  std::vector<double> ms;
+};
+
+static void print_stage(Stage &s) {
+  if (s.ms.empty()) {
+    printf("%-12s %10s\n", s.name.c_str(), "skipped");
+    return;
+  }
+
+  std::sort(s.ms.begin(), s.ms.end());
+  double total = 0;
+  for (double v : s.ms)
+    total += v;
+  auto at = [&](double q) { return s.ms[size_t(q * (s.ms.size() - 1))]; };
+  printf("%-12s %10.2f %10.2f %10.2f %10.2f %12.1f\n", s.name.c_str(),
+         s.ms.front(), at(0.5), at(0.95), s.ms.back(), total);
+}
+
+struct BenchArgs {
+  std::string fname;
+  int width = 1920;
+  int height = 1080;
+  bool fit_page = true;
+  bool use_x = true;
+  bool kernels = false;
+  int repeat = 1;
+};
+
+static BenchArgs parse_args(int argc, char **argv) {
+  BenchArgs a;
+  auto value = [&](int &i) {
+    (i >= argc - 1) && error(std::string("Missing ") + argv[i] + " value.");
+    return atoi(argv[++i]);
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-g") {
+      a.width = value(i);
+      a.height = value(i);
+    } else if (arg == "-r")
+      a.repeat = std::max(1, value(i));
+    else if (arg == "-w")
+      a.fit_page = false;
+    else if (arg == "-n")
+      a.use_x = false;
+    else if (arg == "-k")
+      a.kernels = true;
+    else
+      a.fname = arg;
+  }
+
+  if (a.fname == "" && !a.kernels)
+    error(std::string("Missing pdf file, usage: ") + argv[0] +
+          " [-g width height] [-w] [-n] [-r repeat] pdf_file | -k.");
+  return a;
+}
+
+// Times the pixel conversion kernels of the upload path on a window sized
+// image, for each format and every SIMD level the CPU supports.
+static void bench_kernels(const BenchArgs &a) {
+  std::vector<uint32_t> src(size_t(a.width) * a.height);
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = 0xff000000 | (uint32_t(i * 2654435761u) & 0xffffff);
+  std::vector<char> dst(src.size() * 4);
+
+  bool msb = std::endian::native == std::endian::big;
+  struct {
+    const char *name;
+    PixelFormat format;
+  } formats[] = {{"argb32", {24, 32, msb, 0xff0000, 0xff00, 0xff}},
+                 {"rgb565", {16, 16, msb, 0xf800, 0x07e0, 0x1f}},
+                 {"rgb30", {30, 32, msb, 0x3ff00000, 0xffc00, 0x3ff}},
+                 {"bgr24", {24, 24, !msb, 0xff, 0xff00, 0xff0000}}};
+  const char *levels[] = {"scalar", "sse2", "avx2"};
+
+  printf("%dx%d, %d repeats\n", a.width, a.height, a.repeat);
+  printf("%-12s %10s %10s %10s %10s %12s\n", "kernel (ms)", "min", "median",
+         "p95", "max", "total");
+  for (auto &f : formats) {
+    for (int l = 0; l <= int(get_simd_level()); ++l) {
+      Stage s{std::string(f.name) + "/" + levels[l], {}};
+      for (int r = 0; r < std::max(10, a.repeat); ++r) {
+        auto start = Clock::now();
+        for (int y = 0; y < a.height; ++y)
+          convert_pixels(f.format, src.data() + size_t(y) * a.width,
+                         dst.data() + size_t(y) * a.width * 4, a.width,
+                         SimdLevel(l));
+        s.ms.push_back(since(start));
+      }
+      print_stage(s);
+    }
+  }
+}
+
+// Walks every page through the same render and upload code as spdf and
+// reports how long each stage took. Without X (-n, or no display) only the
+// poppler stages are measured.
+int main(int argc, char **argv) {
+  Display *display = NULL;
+  try {
+    auto args = parse_args(argc, argv);
+    if (args.kernels) {
+      bench_kernels(args);
+      return 0;
+    }
+    if (auto path = std::getenv("SPDF_TRACE"))
+      trace_open(path);
+
+    auto start = Clock::now();
+    std::unique_ptr<poppler::document> doc(
+        poppler::document::load_from_file(args.fname));
+    (!doc) && error("Cannot open document: " + args.fname + ".");
+    double load_ms = since(start);
+
+    poppler::page_renderer renderer;
+    setup_renderer(renderer);
+
+    if (args.use_x)
+      display = XOpenDisplay(NULL);
+    if (args.use_x && !display)
+      std::cerr << "No X display, upload and expose are skipped." << std::endl;
+
+    std::unique_ptr<Uploader> uploader;
+    Window win = None;
+    if (display) {
+      uploader = std::make_unique<Uploader>(display);
+      win = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0,
+                                args.width, args.height, 0, 0, 0);
+      XMapWindow(display, win);
+      XSync(display, False);
+    }
+
+    Stage create{"create_page", {}}, render{"render_page", {}},
+        upload{"upload", {}}, expose{"expose", {}};
+    srect view{0, 0, args.width, args.height};
+    double megapixels = 0;
+
+    for (int r = 0; r < args.repeat; ++r) {
+      for (int n = 0; n < doc->pages(); ++n) {
+        start = Clock::now();
+        std::unique_ptr<poppler::page> page(doc->create_page(n));
+        create.ms.push_back(since(start));
+        if (!page)
+          continue;
+
+        auto prc = get_pdf_render_conf(args.fit_page, false, 0, view,
+                                       page.get(), false, {}, 0, 1);
+        start = Clock::now();
+        auto img = render_pdf_page(renderer, page.get(), prc);
+        render.ms.push_back(since(start));
+        megapixels += img.width() * double(img.height()) / 1e6;
+
+        if (!display)
+          continue;
+
+        start = Clock::now();
+        Pixmap pxm = uploader->upload(img);
+        XSync(display, False);
+        upload.ms.push_back(since(start));
+
+        auto dirty = intersect(view, prc.pos);
+        start = Clock::now();
+        XCopyArea(display, pxm, win, DefaultGC(display, DefaultScreen(display)),
+                  dirty.x() - prc.pos.x(), dirty.y() - prc.pos.y(),
+                  dirty.width(), dirty.height(), dirty.x(), dirty.y());
+        XSync(display, False);
+        expose.ms.push_back(since(start));
+
+        XFreePixmap(display, pxm);
+      }
+    }
+
+    printf("%s: %d pages, %dx%d %s, load %.1f ms, %.1f Mpx rendered\n",
+           args.fname.c_str(), doc->pages(), args.width, args.height,
+           args.fit_page ? "fit page" : "fit width", load_ms, megapixels);
+    if (uploader)
+      printf("upload path: %s\n", uploader->using_shm() ? "shm" : "XPutImage");
+    printf("%-12s %10s %10s %10s %10s %12s\n", "stage (ms)", "min", "median",
+           "p95", "max", "total");
+    for (auto s : {&create, &render, &upload, &expose})
+      print_stage(*s);
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    if (display)
+      XCloseDisplay(display);
+    return EXIT_FAILURE;
+  }
+
+  if (display)
+    XCloseDisplay(display);
+  trace_close();
+  return 0;
+}
@@ -17,6 +17,8 @@ enum Action {
   FIT_WIDTH,
   DOWN,
   UP,
+  LEFT,
+  RIGHT,
   BACK,
   RELOAD,
   GOTO_PAGE,
@@ -24,7 +26,12 @@ enum Action {
   PAGE,
   MAGNIFY,
   ROTATE_CW,
-  ROTATE_CCW
+  ROTATE_CCW,
+  CONTINUOUS,
+  OVERVIEW,
+  ZOOM_IN,
+  ZOOM_OUT,
+  ZOOM_RESET
 };
 
 struct Shortcut {
@@ -53,8 +60,12 @@ static Shortcut shortcuts[] = {{AnyMask, XK_q, QUIT},
                                {ControlMask, XK_End, LAST},
                                {EmptyMask, XK_z, FIT_PAGE},
                                {EmptyMask, XK_w, FIT_WIDTH},
+                               {EmptyMask, XK_c, CONTINUOUS},
+                               {EmptyMask, XK_o, OVERVIEW},
                                {EmptyMask, XK_Down, DOWN},
                                {EmptyMask, XK_Up, UP},
+                               {EmptyMask, XK_Left, LEFT},
+                               {EmptyMask, XK_Right, RIGHT},
                                {EmptyMask, XK_b, BACK},
                                {AnyMask, XK_r, RELOAD},
                                {AnyMask, XK_g, GOTO_PAGE},
@@ -63,7 +74,11 @@ static Shortcut shortcuts[] = {{AnyMask, XK_q, QUIT},
                                {EmptyMask, XK_p, PAGE},
                                {EmptyMask, XK_m, MAGNIFY},
                                {EmptyMask, XK_bracketright, ROTATE_CW},
-                               {EmptyMask, XK_bracketleft, ROTATE_CCW}};
+                               {EmptyMask, XK_bracketleft, ROTATE_CCW},
+                               {EmptyMask, XK_equal, ZOOM_IN},
+                               {ShiftMask, XK_plus, ZOOM_IN},
+                               {EmptyMask, XK_minus, ZOOM_OUT},
+                               {EmptyMask, XK_0, ZOOM_RESET}};
 
 /*
  * Scrolling speed (in page fractions).
@@ -72,6 +87,95 @@ static double arrow_scroll = 0.01;
 static double page_scroll = 0.30;
 static double mouse_scroll = 0.02;
 
+/*
+ * Zoom factor of each key press and of each Ctrl+wheel step, and the range
+ * of zoom allowed on top of fit page and fit width. While zooming the window
+ * is scaled on the server, pages are rendered again once no zoom input came
+ * for zoom_settle_ms.
+ */
+static double zoom_key_step = 1.25;
+static double zoom_wheel_step = 1.1;
+static double zoom_min = 0.25;
+static double zoom_max = 8;
+static int zoom_settle_ms = 250;
+
+/*
+ * Space between pages in continuous mode (in pixels).
+ */
+static int page_gap = 8;
+
+/*
+ * Size of the page thumbnails in overview mode and space between them (in
+ * pixels), and number of thumbnails kept in memory.
+ */
+static int thumb_size = 128;
+static int thumb_gap = 16;
+static int thumb_slots = 256;
+
+/*
+ * Number of pages rendered ahead of and behind the current one by background
+ * threads, number of render threads and memory kept for rendered pages and
+ * tiles (in bytes).
+ */
+static int prefetch_depth = 2;
+static int render_threads = 2;
+static size_t cache_size = 256 << 20;
+
+/*
+ * Number of page objects kept for the pages recently shown.
+ */
+static int page_cache_size = 16;
+
+/*
+ * Fit width and magnified pages are rendered in square tiles of tile_size
+ * pixels. Tiles up to tile_margin pixels outside of the window are rendered
+ * in the background.
+ */
+static int tile_size = 512;
+static int tile_margin = 512;
+
+/*
+ * Pages are first rendered as a preview without antialiasing at preview_scale
+ * of the resolution. When that suggests the full render takes longer than
+ * progressive_ms, the preview is shown until the full render finishes in the
+ * background. -1 disables previews.
+ */
+static double progressive_ms = 150;
+static double preview_scale = 0.25;
+
+/*
+ * Number of threads extracting the text of the document for searching,
+ * whether to keep the result in $XDG_CACHE_HOME/spdf/index for the next time
+ * the same file is opened, and the most disk space kept indexes may use (in
+ * bytes).
+ */
+static int index_threads = 2;
+static bool save_index = false;
+static size_t index_cache_size = 256 << 20;
+
+/*
+ * Files of at least map_size bytes are mapped into memory instead of read.
+ * When a mapped file is truncated while open, which LaTeX does to its output,
+ * the part cut off reads as zeros until the document is reloaded, so smaller
+ * files are read into memory once.
+ */
+static size_t map_size = 64 << 20;
+
+/*
+ * Whether to keep renders in $XDG_CACHE_HOME/spdf/renders for the next time
+ * the same file is opened, and the most disk space they may use (in bytes).
+ * The last page shown of each file is also remembered and opened again.
+ */
+static bool disk_cache = false;
+static size_t disk_cache_size = size_t(1) << 30;
+
+/*
+ * Whether to reload the document when its file is written, and how long
+ * writes must have stopped before it is (in milliseconds).
+ */
+static bool auto_reload = false;
+static int reload_delay_ms = 100;
+
 /*
  * Status line font, must be in X logical font description format
  * (see: https://en.wikipedia.org/wiki/X_logical_font_description).
@@ -1,40 +1,85 @@
 #include <algorithm>
+#include <cmath>
 
 #include "coordconv.hpp"
 
 CoordConv::CoordConv(const poppler::page *p, const srect &r, bool i,
                      int rotation)
-    : rect(r), inverty(i) {
+    : rect(r), inverty(i), rotation(rotation) {
   auto pbox = p->page_rect();
+  width = pbox.width();
+  height = pbox.height();
 
-  xscale = (pbox.width()) / double(rect.width());
-  yscale = (pbox.height()) / double(rect.height());
+  bool turned = rotation == 90 || rotation == 270;
+  xscale = (turned ? height : width) / double(rect.width());
+  yscale = (turned ? width : height) / double(rect.height());
 }
 
-double CoordConv::to_pdf_x(int x) const { return (x - rect.x()) * xscale; }
-
-double CoordConv::to_pdf_y(int y) const {
+void CoordConv::to_pdf(double &x, double &y) const {
+  double u = (x - rect.x()) * xscale;
+  double v = (y - rect.y()) * yscale;
+  switch (rotation) {
+  case 90:
+    x = v;
+    y = height - u;
+    break;
+  case 180:
+    x = width - u;
+    y = height - v;
+    break;
+  case 270:
+    x = width - v;
+    y = u;
+    break;
+  default:
+    x = u;
+    y = v;
+  }
   if (inverty)
-    return (rect.height() - (y - rect.y())) * yscale;
-  return (y - rect.y()) * yscale;
+    y = height - y;
 }
 
-srect CoordConv::to_pdf(const srect &r) const {
-  return {(int)to_pdf_x(r.x()), (int)to_pdf_y(r.y()),
-          (int)(to_pdf_x(r.x() + r.width()) - to_pdf_x(r.x())),
-          (int)(to_pdf_y(r.y() + r.height()) - to_pdf_y(r.y()))};
+void CoordConv::to_screen(double &x, double &y) const {
+  if (inverty)
+    y = height - y;
+  double u, v;
+  switch (rotation) {
+  case 90:
+    u = height - y;
+    v = x;
+    break;
+  case 180:
+    u = width - x;
+    v = height - y;
+    break;
+  case 270:
+    u = y;
+    v = width - x;
+    break;
+  default:
+    u = x;
+    v = y;
+  }
+  x = u / xscale + rect.x();
+  y = v / yscale + rect.y();
 }
 
-double CoordConv::to_screen_x(int x) const { return x / xscale + rect.x(); }
-
-double CoordConv::to_screen_y(int y) const {
-  if (inverty)
-    return rect.y() + rect.height() - y / yscale;
-  return y / yscale + rect.y();
+// Rotations swap and mirror the corners, so the result is rebuilt from the
+// extremes of the two mapped ones.
+srect CoordConv::to_pdf(const srect &r) const {
+  double x0 = r.x(), y0 = r.y();
+  double x1 = r.x() + r.width(), y1 = r.y() + r.height();
+  to_pdf(x0, y0);
+  to_pdf(x1, y1);
+  return {(int)std::min(x0, x1), (int)std::min(y0, y1),
+          (int)std::abs(x1 - x0), (int)std::abs(y1 - y0)};
 }
 
 srect CoordConv::to_screen(const srectf &r) const {
-  return {(int)to_screen_x(r.x()), (int)to_screen_y(r.y()),
-          (int)(to_screen_x(r.x() + r.width()) - to_screen_x(r.x())),
-          (int)(to_screen_y(r.y() + r.height()) - to_screen_y(r.y()))};
+  double x0 = r.x(), y0 = r.y();
+  double x1 = r.x() + r.width(), y1 = r.y() + r.height();
+  to_screen(x0, y0);
+  to_screen(x1, y1);
+  return {(int)std::min(x0, x1), (int)std::min(y0, y1),
+          (int)std::abs(x1 - x0), (int)std::abs(y1 - y0)};
 }
@@ -4,19 +4,21 @@
 #include "rectangle.hpp"
 #include <poppler-page.h>
 
+// Maps between page points and the screen rectangle r the page, turned
+// clockwise by rotation degrees, is drawn into.
 struct CoordConv {
   CoordConv(const poppler::page *p, const srect &r, bool i, int rotation);
-  double to_pdf_x(int x) const;
-  double to_pdf_y(int y) const;
+  void to_pdf(double &x, double &y) const;
   srect to_pdf(const srect &r) const;
-  double to_screen_x(int x) const;
-  double to_screen_y(int y) const;
+  void to_screen(double &x, double &y) const;
   srect to_screen(const srectf &r) const;
 
 private:
   double xscale, yscale;
+  double width, height;
   srect rect;
   bool inverty;
+  int rotation;
 };
 
 #endif
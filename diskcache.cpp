@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "diskcache.hpp"
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+static const char render_magic[8] = {'S', 'P', 'D', 'F', 'R', 'N', 'D', '1'};
+
+// Renders waiting to be written are dropped past this many bytes.
+static const size_t max_queued = 256 << 20;
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t n) {
+  auto p = (const unsigned char *)data;
+  for (size_t i = 0; i < n; ++i)
+    h = (h ^ p[i]) * 0x100000001b3;
+  return h;
+}
+
+// Size, modification time and the first and last MiB identify a file well
+// enough without reading all of it.
+uint64_t get_document_id(const DocumentData &d) {
+  const size_t part = 1 << 20;
+  uint64_t h = 0xcbf29ce484222325;
+  h = hash_bytes(h, &d.size, sizeof(d.size));
+  h = hash_bytes(h, &d.mtime, sizeof(d.mtime));
+  h = hash_bytes(h, d.data, std::min(d.size, part));
+  if (d.size > part)
+    h = hash_bytes(h, d.data + std::max(part, d.size - part),
+                   d.size - std::max(part, d.size - part));
+  return h;
+}
+
+DiskCache::DiskCache(const std::string &d, size_t c) : dir(d), capacity(c) {
+  thread = std::thread(&DiskCache::run, this);
+}
+
+DiskCache::~DiskCache() {
+  {
+    std::lock_guard lk(mtx);
+    stop = true;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+// Renders are looked up for the document with this id from now on.
+void DiskCache::set_document(uint64_t id) { document = id; }
+
+std::string DiskCache::get_path(const RenderKey &k) const {
+  uint64_t h = 0xcbf29ce484222325;
+  int crop[] = {k.crop.x(), k.crop.y(), k.crop.width(), k.crop.height()};
+  h = hash_bytes(h, &k.page, sizeof(k.page));
+  h = hash_bytes(h, &k.dpi, sizeof(k.dpi));
+  h = hash_bytes(h, crop, sizeof(crop));
+  h = hash_bytes(h, &k.rotation, sizeof(k.rotation));
+
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-%d-%016llx",
+           (unsigned long long)document.load(), k.page,
+           (unsigned long long)h);
+  return dir + name;
+}
+
+// Only looks for the file, so it is cheap enough for the UI thread.
+bool DiskCache::contains(const RenderKey &k) const {
+  std::error_code ec;
+  return fs::exists(get_path(k), ec);
+}
+
+// The file layout is: magic, page, dpi, crop, rotation, width, height, then
+// the rows of pixels compressed with zlib.
+std::optional<poppler::image> DiskCache::load(const RenderKey &k) {
+  TraceSpan span("disk_load");
+  auto path = get_path(k);
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return std::nullopt;
+
+  char magic[8];
+  int page, crop[4], rotation, width, height;
+  double dpi;
+  in.read(magic, 8);
+  in.read((char *)&page, sizeof(page));
+  in.read((char *)&dpi, sizeof(dpi));
+  in.read((char *)crop, sizeof(crop));
+  in.read((char *)&rotation, sizeof(rotation));
+  in.read((char *)&width, sizeof(width));
+  in.read((char *)&height, sizeof(height));
+  if (!in || !std::equal(magic, magic + 8, render_magic) ||
+      page != k.page || dpi != k.dpi || crop[0] != k.crop.x() ||
+      crop[1] != k.crop.y() || crop[2] != k.crop.width() ||
+      crop[3] != k.crop.height() || rotation != k.rotation || width <= 0 ||
+      height <= 0)
+    return std::nullopt;
+
+  std::vector<char> packed((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+  std::vector<char> pixels(size_t(width) * height * 4);
+  uLongf len = pixels.size();
+  if (uncompress((Bytef *)pixels.data(), &len, (const Bytef *)packed.data(),
+                 packed.size()) != Z_OK ||
+      len != pixels.size())
+    return std::nullopt;
+
+  poppler::image img(width, height, poppler::image::format_argb32);
+  for (int y = 0; y < height; ++y)
+    std::memcpy(img.data() + y * img.bytes_per_row(),
+                pixels.data() + size_t(y) * width * 4, size_t(width) * 4);
+
+  // The modification time orders files for trimming.
+  std::error_code ec;
+  fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+  return img;
+}
+
+// Only argb32 renders are kept, the pixels are copied before returning.
+void DiskCache::store(const RenderKey &k, const poppler::image &img) {
+  if (img.format() != poppler::image::format_argb32)
+    return;
+
+  size_t row = size_t(img.width()) * 4;
+  Pending p{get_path(k), k, img.width(), img.height(), {}};
+  {
+    std::lock_guard lk(mtx);
+    if (queued + row * img.height() > max_queued)
+      return;
+    queued += row * img.height();
+  }
+
+  p.pixels.resize(row * img.height());
+  for (int y = 0; y < img.height(); ++y)
+    std::memcpy(p.pixels.data() + y * row,
+                img.const_data() + y * img.bytes_per_row(), row);
+
+  {
+    std::lock_guard lk(mtx);
+    queue.push_back(std::move(p));
+  }
+  cv.notify_one();
+}
+
+void DiskCache::run() {
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  for (auto &e : fs::directory_iterator(dir, ec))
+    size += e.file_size(ec);
+  trim();
+
+  std::unique_lock lk(mtx);
+  while (true) {
+    cv.wait(lk, [&]() { return stop || !queue.empty(); });
+    if (stop)
+      return;
+
+    auto p = std::move(queue.front());
+    queue.pop_front();
+    lk.unlock();
+
+    write(p);
+    if (size > capacity)
+      trim();
+
+    lk.lock();
+    queued -= p.pixels.size();
+  }
+}
+
+void DiskCache::write(const Pending &p) {
+  TraceSpan span("disk_store");
+  std::vector<char> packed(compressBound(p.pixels.size()));
+  uLongf len = packed.size();
+  if (compress2((Bytef *)packed.data(), &len, (const Bytef *)p.pixels.data(),
+                p.pixels.size(), Z_BEST_SPEED) != Z_OK)
+    return;
+
+  int crop[] = {p.key.crop.x(), p.key.crop.y(), p.key.crop.width(),
+                p.key.crop.height()};
+  auto tmp = p.path + ".tmp";
+  bool written;
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(render_magic, 8);
+    out.write((const char *)&p.key.page, sizeof(p.key.page));
+    out.write((const char *)&p.key.dpi, sizeof(p.key.dpi));
+    out.write((const char *)crop, sizeof(crop));
+    out.write((const char *)&p.key.rotation, sizeof(p.key.rotation));
+    out.write((const char *)&p.width, sizeof(p.width));
+    out.write((const char *)&p.height, sizeof(p.height));
+    out.write(packed.data(), len);
+    out.close();
+    written = bool(out);
+  }
+
+  std::error_code ec;
+  if (!written) {
+    fs::remove(tmp, ec);
+    return;
+  }
+
+  // A render written again replaces the old file, which no longer counts.
+  size_t old = fs::file_size(p.path, ec);
+  if (ec)
+    old = 0;
+  fs::rename(tmp, p.path, ec);
+  if (ec) {
+    fs::remove(tmp, ec);
+    return;
+  }
+  size -= std::min(size, old);
+  size_t added = fs::file_size(p.path, ec);
+  if (!ec)
+    size += added;
+}
+
+// A tenth of the capacity is freed, so trimming does not happen on every
+// write.
+size_t trim_dir(const std::string &dir, size_t capacity) {
+  TraceSpan span("disk_trim");
+  struct File {
+    fs::path path;
+    fs::file_time_type time;
+    size_t size;
+  };
+  std::vector<File> files;
+  std::error_code ec;
+  size_t size = 0;
+  for (auto &e : fs::directory_iterator(dir, ec)) {
+    files.push_back({e.path(), e.last_write_time(ec), e.file_size(ec)});
+    size += files.back().size;
+  }
+  std::sort(files.begin(), files.end(),
+            [](const File &a, const File &b) { return a.time < b.time; });
+
+  if (size <= capacity)
+    return size;
+  for (auto &f : files) {
+    if (size <= capacity / 10 * 9)
+      break;
+    if (fs::remove(f.path, ec))
+      size -= f.size;
+  }
+  return size;
+}
+
+void DiskCache::trim() {
+  if (size > capacity)
+    size = trim_dir(dir, capacity);
+}
+
+// Positions are kept by absolute path, so they survive the file changing.
+static std::string get_position_path(const std::string &dir,
+                                     const std::string &file_name) {
+  std::error_code ec;
+  auto abs = fs::absolute(file_name, ec).string();
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx",
+           (unsigned long long)hash_bytes(0xcbf29ce484222325, abs.data(),
+                                          abs.size()));
+  return dir + name;
+}
+
+bool load_position(const std::string &dir, const std::string &file_name,
+                   int &page, int &offset) {
+  std::ifstream in(get_position_path(dir, file_name));
+  return bool(in >> page >> offset);
+}
+
+void save_position(const std::string &dir, const std::string &file_name,
+                   int page, int offset) {
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  std::ofstream out(get_position_path(dir, file_name));
+  out << page << " " << offset << "\n";
+}
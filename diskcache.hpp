@@ -0,0 +1,68 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poppler-image.h>
+
+#include "docdata.hpp"
+#include "render.hpp"
+
+uint64_t get_document_id(const DocumentData &data);
+
+// Removes the least recently modified files of dir until they take at most
+// nine tenths of capacity bytes, if they take more. Returns what is left.
+size_t trim_dir(const std::string &dir, size_t capacity);
+
+// Renders of pages and tiles saved under dir compressed with zlib, so that
+// the next session showing the same document does not render them again.
+// Files are written by a background thread and the least recently used ones
+// are removed to stay under capacity bytes. Safe to use from any thread.
+struct DiskCache {
+  DiskCache(const std::string &dir, size_t capacity);
+  ~DiskCache();
+  void set_document(uint64_t id);
+  bool contains(const RenderKey &k) const;
+  std::optional<poppler::image> load(const RenderKey &k);
+  void store(const RenderKey &k, const poppler::image &img);
+
+private:
+  struct Pending {
+    std::string path;
+    RenderKey key;
+    int width, height;
+    std::vector<char> pixels;
+  };
+
+  std::string get_path(const RenderKey &k) const;
+  void run();
+  void write(const Pending &p);
+  void trim();
+
+  std::string dir;
+  size_t capacity;
+  std::atomic<uint64_t> document{0};
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<Pending> queue;
+  size_t queued = 0;
+  bool stop = false;
+  size_t size = 0;
+  std::thread thread;
+};
+
+bool load_position(const std::string &dir, const std::string &file_name,
+                   int &page, int &offset);
+void save_position(const std::string &dir, const std::string &file_name,
+                   int page, int offset);
+
+#endif
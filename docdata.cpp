@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "docdata.hpp"
+#include "trace.hpp"
+
+// Mappings that a truncated file may fault in, looked up by the SIGBUS
+// handler without locking. A slot is free when its start is 0.
+static const int max_maps = 8;
+static std::atomic<uintptr_t> map_starts[max_maps];
+static std::atomic<size_t> map_sizes[max_maps];
+
+// Pages of a mapping past the new end of its file fault when read. They are
+// replaced with zeros, which poppler reports as a damaged document instead of
+// the viewer being killed, until the reloaded version is swapped in. Faults
+// anywhere else get the default action once the handler returns.
+static void on_sigbus(int, siginfo_t *info, void *) {
+  auto addr = uintptr_t(info->si_addr);
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  for (int i = 0; i < max_maps; ++i) {
+    uintptr_t start = map_starts[i];
+    size_t size = map_sizes[i];
+    if (start == 0 || addr < start || addr >= start + size)
+      continue;
+
+    uintptr_t from = addr & ~(page - 1);
+    if (mmap((void *)from, start + size - from, PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+      return;
+  }
+  signal(SIGBUS, SIG_DFL);
+}
+
+static void add_map(void *p, size_t size) {
+  static std::once_flag installed;
+  std::call_once(installed, []() {
+    struct sigaction sa = {};
+    sa.sa_sigaction = on_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+  });
+
+  for (int i = 0; i < max_maps; ++i) {
+    uintptr_t free = 0;
+    if (map_starts[i].compare_exchange_strong(free, uintptr_t(p))) {
+      map_sizes[i] = size;
+      return;
+    }
+  }
+}
+
+static void remove_map(void *p) {
+  for (int i = 0; i < max_maps; ++i) {
+    uintptr_t start = uintptr_t(p);
+    if (map_starts[i].compare_exchange_strong(start, 0)) {
+      map_sizes[i] = 0;
+      return;
+    }
+  }
+}
+
+DocumentData::~DocumentData() {
+  if (map) {
+    remove_map(map);
+    munmap(map, size);
+  }
+}
+
+// Reads until end of file into buf, which grows by doubling from capacity.
+static bool read_all(int fd, std::vector<char> &buf, size_t capacity) {
+  size_t size = 0;
+  buf.resize(std::max(capacity, size_t(1 << 16)));
+  while (true) {
+    if (size == buf.size())
+      buf.resize(buf.size() * 2);
+
+    ssize_t n = read(fd, buf.data() + size, buf.size() - size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    if (n == 0)
+      break;
+    size += n;
+  }
+  buf.resize(size);
+  return true;
+}
+
+// "-" reads standard input. Files of at least map_size bytes are mapped, with
+// what a truncation cuts off reading as zeros, smaller ones are read once.
+std::shared_ptr<const DocumentData>
+read_document_data(const std::string &file_name, size_t map_size) {
+  TraceSpan span("read");
+  auto d = std::make_shared<DocumentData>();
+  d->file_name = file_name;
+
+  if (file_name == "-") {
+    if (!read_all(STDIN_FILENO, d->buf, 0))
+      return nullptr;
+    d->data = d->buf.data();
+    d->size = d->buf.size();
+    return d;
+  }
+
+  int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat sb;
+  if (fstat(fd, &sb) == 0)
+    d->mtime = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+  else
+    sb.st_size = 0;
+
+  if (S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+      size_t(sb.st_size) >= map_size) {
+    void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      close(fd);
+      add_map(p, sb.st_size);
+      d->map = p;
+      d->data = (const char *)p;
+      d->size = sb.st_size;
+      return d;
+    }
+  }
+
+  bool ok = read_all(fd, d->buf, sb.st_size + 1);
+  close(fd);
+  if (!ok)
+    return nullptr;
+  d->data = d->buf.data();
+  d->size = d->buf.size();
+  return d;
+}
+
+// The document keeps its data alive. poppler takes the length as an int, so
+// files over 2 GiB are left to poppler to read.
+std::shared_ptr<poppler::document>
+load_document(std::shared_ptr<const DocumentData> data) {
+  if (!data)
+    return nullptr;
+
+  TraceSpan span("load");
+  poppler::document *doc;
+  if (data->size > INT_MAX && data->file_name != "-")
+    doc = poppler::document::load_from_file(data->file_name);
+  else if (data->size > INT_MAX)
+    doc = NULL;
+  else
+    doc = poppler::document::load_from_raw_data(data->data, data->size);
+  if (!doc)
+    return nullptr;
+
+  return std::shared_ptr<poppler::document>(
+      doc, [data](poppler::document *d) { delete d; });
+}
+
+DocumentSource::DocumentSource(std::shared_ptr<const DocumentData> d)
+    : data(d) {}
+
+std::shared_ptr<const DocumentData> DocumentSource::get() const {
+  std::lock_guard lk(mtx);
+  return data;
+}
+
+void DocumentSource::set(std::shared_ptr<const DocumentData> d) {
+  std::lock_guard lk(mtx);
+  data = d;
+}
+
+std::shared_ptr<poppler::document> DocumentSource::open() const {
+  return load_document(get());
+}
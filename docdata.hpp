@@ -0,0 +1,51 @@
+#ifndef DOCDATA_H
+#define DOCDATA_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <poppler-document.h>
+
+// Contents of a document file, mapped or read into memory, that poppler
+// parses in place. One copy is shared by every thread with the document open.
+struct DocumentData {
+  DocumentData() = default;
+  DocumentData(const DocumentData &) = delete;
+  DocumentData &operator=(const DocumentData &) = delete;
+  ~DocumentData();
+
+  std::string file_name;
+  const char *data = NULL;
+  size_t size = 0;
+  int64_t mtime = 0;
+
+  void *map = NULL;
+  std::vector<char> buf;
+};
+
+using DocumentOpener = std::function<std::shared_ptr<poppler::document>()>;
+
+std::shared_ptr<const DocumentData>
+read_document_data(const std::string &file_name, size_t map_size);
+
+std::shared_ptr<poppler::document>
+load_document(std::shared_ptr<const DocumentData> data);
+
+// The data documents are currently opened from, replaced when the file is
+// reloaded.
+struct DocumentSource {
+  DocumentSource(std::shared_ptr<const DocumentData> data);
+  std::shared_ptr<const DocumentData> get() const;
+  void set(std::shared_ptr<const DocumentData> data);
+  std::shared_ptr<poppler::document> open() const;
+
+private:
+  mutable std::mutex mtx;
+  std::shared_ptr<const DocumentData> data;
+};
+
+#endif
@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#include <poppler-page-renderer.h>
+#include <poppler-page.h>
+
+#include "export.hpp"
+#include "render.hpp"
+#include "trace.hpp"
+
+static PdfRenderConf get_export_conf(const poppler::page *page,
+                                     const ExportOptions &o) {
+  if (o.width > 0 && o.height > 0)
+    return get_pdf_render_conf(true, false, 0, {0, 0, o.width, o.height},
+                               page, false, {}, 0, 1);
+
+  auto r = page->page_rect();
+  double scale = o.dpi / 72.0;
+  int w = r.width() * scale, h = r.height() * scale;
+  return {o.dpi,
+          {0, 0, w, h},
+          {int(r.x() * scale), int(r.y() * scale), w, h},
+          0};
+}
+
+// Row y of an argb32 image as 8 bit RGB.
+static void get_rgb_row(const poppler::image &img, int y, unsigned char *out) {
+  auto p = (const uint32_t *)(img.const_data() +
+                              size_t(y) * img.bytes_per_row());
+  for (int x = 0; x < img.width(); ++x) {
+    out[3 * x] = p[x] >> 16;
+    out[3 * x + 1] = p[x] >> 8;
+    out[3 * x + 2] = p[x];
+  }
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void write_ppm(std::ofstream &out, const poppler::image &img) {
+  out << "P6\n" << img.width() << " " << img.height() << "\n255\n";
+  std::vector<unsigned char> row(size_t(img.width()) * 3);
+  for (int y = 0; y < img.height(); ++y) {
+    get_rgb_row(img, y, row.data());
+    out.write((const char *)row.data(), row.size());
+  }
+}
+
+static void write_png_chunk(std::ofstream &out, const char *type,
+                            const unsigned char *data, size_t size) {
+  unsigned char buf[4];
+  put_u32(buf, size);
+  out.write((const char *)buf, 4);
+  out.write(type, 4);
+  out.write((const char *)data, size);
+
+  // zlib restarts the checksum when given no data.
+  uLong crc = crc32(0, (const Bytef *)type, 4);
+  if (size > 0)
+    crc = crc32(crc, data, size);
+  put_u32(buf, crc);
+  out.write((const char *)buf, 4);
+}
+
+// Rows are compressed one at a time into IDAT chunks of up to 64 KiB, without
+// a copy of the whole image.
+static void write_png(std::ofstream &out, const poppler::image &img) {
+  static const unsigned char signature[] = {0x89, 'P',  'N',  'G',
+                                            '\r', '\n', 0x1a, '\n'};
+  out.write((const char *)signature, sizeof(signature));
+
+  unsigned char header[13] = {};
+  put_u32(header, img.width());
+  put_u32(header + 4, img.height());
+  header[8] = 8; // Bits per channel.
+  header[9] = 2; // RGB.
+  write_png_chunk(out, "IHDR", header, sizeof(header));
+
+  z_stream zs = {};
+  if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+    throw std::runtime_error("Cannot initialize zlib.");
+
+  std::vector<unsigned char> packed(64 << 10);
+  auto flush = [&]() {
+    size_t n = packed.size() - zs.avail_out;
+    if (n > 0)
+      write_png_chunk(out, "IDAT", packed.data(), n);
+    zs.next_out = packed.data();
+    zs.avail_out = packed.size();
+  };
+  zs.next_out = packed.data();
+  zs.avail_out = packed.size();
+
+  // Each row starts with its filter type, 0 for none.
+  std::vector<unsigned char> row(1 + size_t(img.width()) * 3);
+  for (int y = 0; y < img.height(); ++y) {
+    get_rgb_row(img, y, row.data() + 1);
+    zs.next_in = row.data();
+    zs.avail_in = row.size();
+    while (zs.avail_in > 0) {
+      deflate(&zs, Z_NO_FLUSH);
+      if (zs.avail_out == 0)
+        flush();
+    }
+  }
+  while (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    flush();
+  flush();
+  deflateEnd(&zs);
+
+  write_png_chunk(out, "IEND", NULL, 0);
+}
+
+static void write_image(const std::string &path, const poppler::image &img,
+                        bool png) {
+  TraceSpan span("write_image");
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (out) {
+    if (png)
+      write_png(out, img);
+    else
+      write_ppm(out, img);
+  }
+  if (!out)
+    throw std::runtime_error("Cannot write " + path + ".");
+}
+
+static int get_threads(const ExportOptions &o) {
+  int threads = o.threads > 0
+                    ? o.threads
+                    : std::max(1, int(std::thread::hardware_concurrency()));
+  return std::min(threads, o.last - o.first + 1);
+}
+
+void export_pages(DocumentOpener open, const ExportOptions &o) {
+  std::atomic<int> next{o.first};
+  std::mutex mtx;
+  std::string failure;
+
+  // File names sort in page order.
+  int digits = std::to_string(o.last).size();
+  auto get_path = [&](int n) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "-%0*d.%s", digits, n, o.png ? "png" : "ppm");
+    return o.prefix + buf;
+  };
+
+  auto worker = [&]() {
+    try {
+      auto doc = open();
+      if (!doc)
+        throw std::runtime_error("Cannot open document.");
+      poppler::page_renderer r;
+      setup_renderer(r);
+
+      for (int n; (n = next++) <= o.last;) {
+        std::unique_ptr<poppler::page> page(doc->create_page(n - 1));
+        if (!page)
+          throw std::runtime_error("Cannot create page: " + std::to_string(n) +
+                                   ".");
+        auto img =
+            render_pdf_page(r, page.get(), get_export_conf(page.get(), o));
+        if (!img.is_valid())
+          throw std::runtime_error("Cannot render page: " + std::to_string(n) +
+                                   ".");
+        write_image(get_path(n), img, o.png);
+      }
+    } catch (std::exception &e) {
+      std::lock_guard lk(mtx);
+      if (failure.empty())
+        failure = e.what();
+      next = o.last + 1;
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (int i = 0, threads = get_threads(o); i < threads; ++i)
+    pool.emplace_back(worker);
+  for (auto &t : pool)
+    t.join();
+
+  if (!failure.empty())
+    throw std::runtime_error(failure);
+}
+
+// Plain text as laid out on the page, or one word per line after its box in
+// page points.
+static std::string get_page_text(const poppler::page *page, bool boxes) {
+  TraceSpan span("extract_text");
+  std::string text;
+  if (!boxes) {
+    auto utf8 = page->text().to_utf8();
+    text.assign(utf8.begin(), utf8.end());
+  } else {
+    for (auto &b : page->text_list()) {
+      auto r = b.bbox();
+      auto word = b.text().to_utf8();
+      char buf[96];
+      snprintf(buf, sizeof(buf), "%.2f %.2f %.2f %.2f ", r.x(), r.y(),
+               r.width(), r.height());
+      text += buf;
+      text.append(word.begin(), word.end());
+      text += '\n';
+    }
+  }
+  return text + '\f';
+}
+
+void export_text(DocumentOpener open, const ExportOptions &o,
+                 std::ostream &out) {
+  int threads = get_threads(o);
+  // Pages taken by workers stay within window pages of the one written next.
+  int window = 4 * threads;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::map<int, std::string> ready;
+  int next = o.first, written = o.first;
+  std::string failure;
+
+  auto fail = [&](const std::string &m) {
+    {
+      std::lock_guard lk(mtx);
+      if (failure.empty())
+        failure = m;
+    }
+    cv.notify_all();
+  };
+
+  auto worker = [&]() {
+    try {
+      auto doc = open();
+      if (!doc)
+        throw std::runtime_error("Cannot open document.");
+
+      while (true) {
+        int n;
+        {
+          std::unique_lock lk(mtx);
+          cv.wait(lk, [&]() {
+            return !failure.empty() || next > o.last ||
+                   next < written + window;
+          });
+          if (!failure.empty() || next > o.last)
+            return;
+          n = next++;
+        }
+
+        std::unique_ptr<poppler::page> page(doc->create_page(n - 1));
+        if (!page)
+          throw std::runtime_error("Cannot create page: " + std::to_string(n) +
+                                   ".");
+        auto text = get_page_text(page.get(), o.boxes);
+        {
+          std::lock_guard lk(mtx);
+          ready.emplace(n, std::move(text));
+        }
+        cv.notify_all();
+      }
+    } catch (std::exception &e) {
+      fail(e.what());
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (int i = 0; i < threads; ++i)
+    pool.emplace_back(worker);
+
+  // Pages are written as soon as every page before them was.
+  while (true) {
+    std::string text;
+    {
+      std::unique_lock lk(mtx);
+      cv.wait(lk, [&]() {
+        return !failure.empty() || written > o.last || ready.count(written);
+      });
+      if (!failure.empty() || written > o.last)
+        break;
+      auto it = ready.find(written);
+      text = std::move(it->second);
+      ready.erase(it);
+      ++written;
+    }
+    cv.notify_all();
+
+    out.write(text.data(), text.size());
+    out.flush();
+    if (!out)
+      fail("Cannot write text.");
+  }
+
+  for (auto &t : pool)
+    t.join();
+
+  if (!failure.empty())
+    throw std::runtime_error(failure);
+}
@@ -0,0 +1,37 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <ostream>
+#include <string>
+
+#include "docdata.hpp"
+
+// Pages first to last (counted from 1), rendered at dpi or, when width and
+// height are set, fitted into them the way fit page shows them. Their text
+// comes with the box of each word when boxes is set.
+struct ExportOptions {
+  int first = 1;
+  int last = 0;
+  double dpi = 150;
+  int width = 0;
+  int height = 0;
+  bool png = true;
+  std::string prefix = "page";
+  int threads = 0;
+  bool boxes = false;
+};
+
+// Writes every page to prefix-<page>.png (or .ppm) from threads that each
+// open their own document and renderer, one core each unless threads is set.
+// Pages are written out as soon as they are rendered, so memory use does not
+// depend on the length of the document. Throws on the first failure.
+void export_pages(DocumentOpener open, const ExportOptions &o);
+
+// Writes the text of every page to out, each followed by a form feed, in
+// page order. Threads extract pages ahead of the one being written, but no
+// further than a few pages each, so memory use does not depend on the length
+// of the document either. Throws on the first failure.
+void export_text(DocumentOpener open, const ExportOptions &o,
+                 std::ostream &out);
+
+#endif
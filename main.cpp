@@ -1,14 +1,23 @@
 #include <algorithm>
 #include <cctype>
 #include <charconv>
+#include <chrono>
 #include <clocale>
+#include <cstdio>
 #include <cstdlib>
 #include <exception>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stack>
 #include <stdexcept>
 #include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <poppler-document.h>
 #include <poppler-page-renderer.h>
@@ -16,10 +25,25 @@
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
 #include <X11/keysym.h>
 
 #include "coordconv.hpp"
+#include "diskcache.hpp"
+#include "docdata.hpp"
+#include "export.hpp"
+#include "pagecache.hpp"
+#include "pagesizes.hpp"
+#include "pixcache.hpp"
 #include "rectangle.hpp"
+#include "render.hpp"
+#include "renderpool.hpp"
+#include "search.hpp"
+#include "textindex.hpp"
+#include "thumbatlas.hpp"
+#include "trace.hpp"
+#include "upload.hpp"
+#include "watcher.hpp"
 
 #include "config.hpp"
 
@@ -33,13 +57,21 @@ struct PageAndOffset {
 };
 
 struct AppState {
-  std::unique_ptr<poppler::document> doc;
+  std::string file_name;
+  std::shared_ptr<DocumentSource> source;
+  std::shared_ptr<poppler::document> doc;
+  std::unique_ptr<PageCache> page_cache;
   poppler::page *page = NULL;
   std::unique_ptr<poppler::page_renderer> renderer;
+  std::unique_ptr<poppler::page_renderer> preview_renderer;
+  // Time taken by the last full render of render_page or of its tiles.
+  double render_ms = 0;
+  int render_page = 0;
   int page_num;
   bool fit_page;
   bool scrolling_up;
   int next_pos_y = 0;
+  std::optional<srect> next_pos;
   std::stack<PageAndOffset> page_stack;
 
   Display *display = NULL;
@@ -47,11 +79,44 @@ struct AppState {
   srect main_pos;
   Pixmap pdf = None;
   srect pdf_pos{0, 0, 0, 0};
+  PdfRenderConf pdf_conf;
+  bool relayout = true;
+  bool tiled = false;
+  bool prefetch = false;
+
+  bool continuous = false;
+  std::vector<poppler::rectf> page_rects;
+  std::unique_ptr<PageSizes> sizes;
+  std::vector<PdfRenderConf> layout;
+  int doc_x = 0;
+  int doc_y = 0;
+  double page_frac = 0;
+  double page_frac_x = 0;
+
+  bool overview = false;
+  int overview_y = 0;
+  std::unique_ptr<ThumbAtlas> atlas;
+
+  int wake_fd = -1;
+  std::vector<srect> damage;
+  // Drawn already but to be copied to the window again.
+  std::vector<srect> exposed;
+  int scroll_dx = 0;
+  int scroll_dy = 0;
+  std::unique_ptr<PixmapCache> cache;
+  std::unique_ptr<RenderPool> pool;
+  std::unique_ptr<DiskCache> disk;
+  std::unique_ptr<Uploader> uploader;
 
   GC selection_gc;
+  // Frames are composed here and copied to the window once per repaint.
+  Pixmap back = None;
+  GC back_gc;
   srect selection{0, 0, 0, 0};
   srectf pdf_selection{0, 0, 0, 0};
   bool selecting = false;
+  // Part of the selection being dragged that is inverted on screen.
+  srect band{0, 0, 0, 0};
 
   GC status_gc;
   GC text_gc;
@@ -64,7 +129,19 @@ struct AppState {
   bool status = false;
   bool input = false;
 
-  srectf pos;
+  std::unique_ptr<Watcher> watcher;
+  std::shared_ptr<TextIndex> index;
+  std::shared_ptr<Search> search;
+  // Searches for shorter versions of the query being typed, shortest first.
+  std::vector<std::shared_ptr<Search>> search_stack;
+  // Searches dropped from the UI thread end on this one.
+  std::unique_ptr<SearchReaper> reaper;
+  bool search_backwards = false;
+  bool search_pending = false;
+  bool search_refined = false;
+  size_t search_hits_shown = 0;
+  int match_page = 0;
+  size_t match = 0;
   bool searching = false;
 
   bool xembed_init = false;
@@ -74,12 +151,26 @@ struct AppState {
   int pre_mag_y;
 
   int rotation = 0;
+
+  // While zooming, zoom_src holds the window as it was when the gesture
+  // started and is shown scaled by zoom_target / zoom and shifted by
+  // zoom_x, zoom_y.
+  double zoom = 1;
+  bool zooming = false;
+  double zoom_target = 1;
+  double zoom_x = 0;
+  double zoom_y = 0;
+  Pixmap zoom_src = None;
+  Picture zoom_src_pic = None;
+  Picture zoom_dst_pic = None;
+  std::chrono::steady_clock::time_point zoom_deadline;
 };
 
 struct SetupXRet {
   Display *display;
   Window main;
   GC selection;
+  GC back;
   GC status;
   GC text;
   XFontSet fset;
@@ -100,6 +191,9 @@ static SetupXRet setup_x(unsigned width, unsigned height,
     root = DefaultRootWindow(display);
   Window main =
       XCreateSimpleWindow(display, root, 0, 0, width, height, 2, 0, ec.pixel);
+  // Every pixel is copied from the back buffer, clearing exposed areas first
+  // would only make them flicker.
+  XSetWindowBackgroundPixmap(display, main, None);
 
   std::string window_name("spdf: " + file_name);
   std::string icon_name("spdf");
@@ -134,6 +228,14 @@ static SetupXRet setup_x(unsigned width, unsigned height,
   gcvals2.foreground = WhitePixel(display, DefaultScreen(display));
   GC gc2 = XCreateGC(display, main, GCForeground, &gcvals2);
 
+  // Clears the back buffer and copies it to the window. Nothing copied from a
+  // pixmap can be obscured, so exposures are not needed.
+  XGCValues gcvals3;
+  gcvals3.foreground = ec.pixel;
+  gcvals3.graphics_exposures = False;
+  GC gc3 = XCreateGC(display, main, GCForeground | GCGraphicsExposures,
+                     &gcvals3);
+
   int nmissing;
   char **missing;
   char *def_string;
@@ -156,185 +258,809 @@ static SetupXRet setup_x(unsigned width, unsigned height,
                KeyPressMask | ButtonPressMask | ButtonReleaseMask |
                    Button1MotionMask | StructureNotifyMask | ExposureMask);
 
-  return {display, main, gc,      DefaultGC(display, DefaultScreen(display)),
-          gc2,     fset, fheight, fbase};
+  return {display, main,    gc,      gc3,
+          DefaultGC(display, DefaultScreen(display)),
+          gc2,     fset,    fheight, fbase};
+}
+
+// Pages are borrowed from the page cache, the current one stays pinned.
+static poppler::page *get_page(AppState &st, int n) {
+  auto page = st.page_cache->get(n);
+  (!page) && error("Cannot create page: " + std::to_string(n) + ".");
+  return page;
+}
+
+static void set_page(AppState &st, int n) {
+  st.page_num = n;
+  st.page = get_page(st, n);
+  st.page_cache->pin(n);
+}
+
+// Where indexes and renders are kept across sessions.
+static std::string get_cache_dir() {
+  if (auto xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+    return std::string(xdg) + "/spdf";
+  if (auto home = std::getenv("HOME"); home && *home)
+    return std::string(home) + "/.cache/spdf";
+  return "";
+}
+
+// Background threads each open their own handle of the document, from the
+// same data.
+static DocumentOpener get_opener(const AppState &st) {
+  return [source = st.source]() { return source->open(); };
+}
+
+// Render, search and reload threads signal an eventfd to get the event loop
+// to pick up their results, they never touch the X connection.
+static void wake_event_loop(const AppState &st) {
+  uint64_t one = 1;
+  ssize_t r = write(st.wake_fd, &one, sizeof(one));
+  (void)r;
+}
+
+static std::shared_ptr<TextIndex> make_index(const AppState &st) {
+  return std::make_shared<TextIndex>(get_opener(st), st.source->get(),
+                                     st.doc->pages(), index_threads,
+                                     save_index ? get_cache_dir() : "",
+                                     index_cache_size);
 }
 
-static void cleanup_x(const AppState &st) {
+// Drops the search and the ones kept to narrow it down, without waiting for
+// their threads.
+static void drop_searches(AppState &st) {
+  st.reaper->release(std::move(st.search));
+  for (auto &s : st.search_stack)
+    st.reaper->release(std::move(s));
+  st.search_stack.clear();
+}
+
+// Where the last page shown of each file is kept.
+static std::string get_position_dir() {
+  auto dir = get_cache_dir();
+  return dir.empty() ? "" : dir + "/positions";
+}
+
+static void cleanup_x(AppState &st) {
+  if (disk_cache && st.doc && st.file_name != "-" &&
+      !get_position_dir().empty())
+    save_position(get_position_dir(), st.file_name, st.page_num,
+                  st.pdf_pos.y());
+  st.watcher.reset();
+  if (st.reaper)
+    drop_searches(st);
+  st.reaper.reset();
+  st.index.reset();
+  st.sizes.reset();
+  st.pool.reset();
+  st.disk.reset();
+  st.cache.reset();
+  st.atlas.reset();
+  st.uploader.reset();
+  if (st.wake_fd >= 0)
+    close(st.wake_fd);
+  if (st.back != None)
+    XFreePixmap(st.display, st.back);
   if (st.fset != NULL)
     XFreeFontSet(st.display, st.fset);
-  if (st.pdf != None)
-    XFreePixmap(st.display, st.pdf);
   if (st.display != NULL)
     XCloseDisplay(st.display);
+  trace_close();
 }
 
-struct PdfRenderConf {
-  double dpi;
-  srect pos;
-  srect crop;
-};
+static Pixmap upload_image(const AppState &st, poppler::image &img) {
+  return st.uploader->upload(img);
+}
 
-PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int offset,
-                                  srect p, const poppler::page *page,
-                                  bool magnifying, srectf m, int rotation) {
-  auto rect = page->page_rect();
-  auto x0 = rect.x();
-  auto y0 = rect.y();
-  auto width = rect.width();
-  auto height = rect.height();
-
-  if (magnifying) {
-    x0 = m.x();
-    y0 = m.y();
-    width = m.width();
-    height = m.height();
-  }
-
-  int x, y, w, h;
-  double dpi;
-  if (fit_page) {
-    if (double(p.width()) / double(p.height()) > width / height) {
-      h = p.height();
-      dpi = double(p.height()) * 72.0 / height;
-      w = width * dpi / 72.0;
-
-      y = 0;
-      x = (p.width() - w) / 2;
-    } else {
-      w = p.width();
-      dpi = double(p.width()) * 72.0 / width;
-      h = height * dpi / 72.0;
-
-      x = 0;
-      y = (p.height() - h) / 2;
-    }
+// The render of the current page, following the scroll position.
+static PdfRenderConf get_pdf_conf(const AppState &st) {
+  auto prc = st.pdf_conf;
+  prc.pos = {st.pdf_pos.x(), st.pdf_pos.y(), prc.crop.width(),
+             prc.crop.height()};
+  return prc;
+}
+
+static RenderKey get_render_key(const AppState &st, int page,
+                                const PdfRenderConf &prc) {
+  return {page, prc.dpi, prc.crop, prc.rotation};
+}
+
+// Renders read back from the disk cache took no time and are not counted.
+static void add_render_time(AppState &st, int page, double ms) {
+  if (page == st.page_num && ms > 0) {
+    st.render_ms = ms;
+    st.render_page = page;
+  }
+}
+
+static Bool is_input_event(Display *, XEvent *e, XPointer found) {
+  if (e->type == KeyPress || e->type == ButtonPress)
+    *(bool *)found = true;
+  return False;
+}
+
+// Whether a key or button press is already waiting to be handled.
+static bool has_pending_input(Display *d) {
+  bool found = false;
+  XEvent e;
+  XCheckIfEvent(d, &e, is_input_event, (XPointer)&found);
+  return found;
+}
+
+// Returns the render of page n (or of a tile) described by prc, from the cache
+// or the render pool if possible. Renders in the disk cache are left to the
+// pool to read, and None is returned until it is done. Otherwise a quick preview is rendered first,
+// and when its cost says the full render would take longer than
+// progressive_ms, the preview is returned and the full render is left to the
+// render pool. When more input is queued, which is likely to move away from
+// here (a key held down), nothing is rendered and None is returned until the
+// pool is done.
+static Pixmap get_cached_pixmap(AppState &st, int n,
+                                const poppler::page *page,
+                                const PdfRenderConf &prc) {
+  auto key = get_render_key(st, n, prc);
+  Pixmap pxm = st.cache->get(key);
+  if (pxm != None) {
+    // The full render may have been dropped when we navigated away.
+    if (st.cache->is_preview(key))
+      st.prefetch = true;
+    return pxm;
+  }
+
+  size_t bytes = size_t(prc.crop.width()) * prc.crop.height() * 4;
+  bool progressive = progressive_ms >= 0;
+  bool defer = has_pending_input(st.display);
+  auto res = st.pool->take(key, !progressive && !defer);
+  if (res) {
+    add_render_time(st, n, res->ms);
+    pxm = upload_image(st, res->img);
+  } else if (defer || (st.disk && st.disk->contains(key))) {
+    st.prefetch = true;
+    return None;
   } else {
-    w = p.width();
-    dpi = double(p.width()) * 72.0 / width;
-    h = height * dpi / 72.0;
-
-    x = 0;
-    if (double(p.width()) / double(p.height()) <= width / height) {
-      y = (p.height() - h) / 2;
-    } else {
-      if (!scrolling_up)
-        y = offset;
-      else
-        y = p.height() - h;
+    if (progressive) {
+      // The preview has a fraction of the pixels of the full render, which
+      // is scaled up from its cost. Pages parsing slowly also look slow here.
+      auto start = std::chrono::steady_clock::now();
+      auto img =
+          render_pdf_preview(*st.preview_renderer, page, prc, preview_scale);
+      std::chrono::duration<double, std::milli> d =
+          std::chrono::steady_clock::now() - start;
+      if (d.count() / (preview_scale * preview_scale) > progressive_ms) {
+        pxm = upload_image(st, img);
+        st.cache->put(key, pxm, bytes, true);
+        st.prefetch = true;
+        return pxm;
+      }
     }
+
+    auto start = std::chrono::steady_clock::now();
+    auto img = render_pdf_page(*st.renderer, page, prc);
+    std::chrono::duration<double, std::milli> d =
+        std::chrono::steady_clock::now() - start;
+    add_render_time(st, n, d.count());
+    if (st.disk)
+      st.disk->store(key, img);
+    pxm = upload_image(st, img);
+  }
+  st.cache->put(key, pxm, bytes);
+  return pxm;
+}
+
+static srect get_view(const AppState &st) {
+  return {0, 0, st.main_pos.width(), st.main_pos.height()};
+}
+
+// Keeps as much of a page at pos in view as its size allows, centering it
+// along the axes where it fits.
+static srect place_page(const srect &pos, const srect &view) {
+  auto place = [](int p, int size, int v) {
+    return size <= v ? (v - size) / 2 : std::clamp(p, v - size, 0);
+  };
+  return {place(pos.x(), pos.width(), view.width()),
+          place(pos.y(), pos.height(), view.height()), pos.width(),
+          pos.height()};
+}
+
+static bool is_continuous(const AppState &st) {
+  return st.continuous && !st.magnifying;
+}
+
+// Page sizes are read once in the background, for the layouts showing every
+// page. Those not read yet are taken to be the size of the current page.
+static void measure_pages(AppState &st) {
+  if (!st.page_rects.empty())
+    return;
+
+  st.page_rects.assign(st.doc->pages(), st.page->page_rect());
+  st.sizes = std::make_unique<PageSizes>(get_opener(st), st.doc->pages(),
+                                         [&st]() { wake_event_loop(st); });
+}
+
+// Width of the continuous layout, that of the widest page or of the window
+// when it is wider.
+static int get_doc_width(const AppState &st) {
+  return std::max(st.main_pos.width(), int(st.main_pos.width() * st.zoom));
+}
+
+// Stacks the pages with the widest fitted to the window width and the others
+// at the same scale, centred like a single page is. Page n is at
+// layout[n - 1] with pos relative to the top of the document.
+static void layout_continuous(AppState &st) {
+  measure_pages(st);
+  bool turned = st.rotation == 90 || st.rotation == 270;
+  auto get_width = [turned](const poppler::rectf &r) {
+    return turned ? r.height() : r.width();
+  };
+  double widest = 0;
+  for (auto &rect : st.page_rects)
+    widest = std::max(widest, get_width(rect));
+  int view_w = st.main_pos.width();
+  int doc_w = get_doc_width(st);
+
+  st.layout.clear();
+  int y = 0;
+  for (auto &rect : st.page_rects) {
+    srect fit{0, 0, int(view_w * get_width(rect) / widest),
+              st.main_pos.height()};
+    auto prc = get_pdf_render_conf(false, false, 0, fit, rect, false, {},
+                                   st.rotation, st.zoom);
+    prc.pos = {(doc_w - prc.crop.width()) / 2, y, prc.crop.width(),
+               prc.crop.height()};
+    y += prc.crop.height() + page_gap;
+    st.layout.push_back(prc);
+  }
+}
+
+// The render of page n in continuous mode, placed where it is on screen.
+static PdfRenderConf get_continuous_conf(const AppState &st, int n) {
+  auto prc = st.layout[n - 1];
+  prc.pos = {prc.pos.x() - st.doc_x, prc.pos.y() - st.doc_y,
+             prc.pos.width(), prc.pos.height()};
+  return prc;
+}
+
+// First and last pages of the continuous layout intersecting area.
+static std::pair<int, int> get_visible_pages(const AppState &st,
+                                             const srect &area) {
+  auto page_at = [&st](int y) {
+    auto it = std::upper_bound(
+        st.layout.begin(), st.layout.end(), st.doc_y + y,
+        [](int y, const PdfRenderConf &prc) { return y < prc.pos.y(); });
+    return std::max(1, int(it - st.layout.begin()));
+  };
+  return {page_at(area.y()), page_at(area.bottom() - 1)};
+}
+
+// Makes the page at the top of the window the current one, unless keep_page
+// is set and the current page is still visible.
+static void set_continuous_page(AppState &st, bool keep_page = false) {
+  auto [first, last] = get_visible_pages(st, get_view(st));
+  int n = first;
+  if (keep_page && st.page_num >= first && st.page_num <= last)
+    n = st.page_num;
+
+  if (n != st.page_num) {
+    st.selection = {0, 0, 0, 0};
+    st.pdf_selection = {0, 0, 0, 0};
   }
+  set_page(st, n);
+  st.pdf_conf = get_continuous_conf(st, n);
+  st.pdf_pos = st.pdf_conf.pos;
+  st.page_frac = double(-st.pdf_pos.y()) / st.pdf_pos.height();
+  st.page_frac_x = double(-st.pdf_pos.x()) / st.pdf_pos.width();
+}
+
+static int get_max_doc_x(const AppState &st) {
+  return get_doc_width(st) - st.main_pos.width();
+}
+
+static int get_max_doc_y(const AppState &st) {
+  return std::max(0, st.layout.back().pos.bottom() - st.main_pos.height());
+}
+
+// Lays the document out for the window width and keeps the same position in
+// the current page.
+static void relayout_continuous(AppState &st) {
+  layout_continuous(st);
+  st.page_num = std::min(st.page_num, int(st.layout.size()));
+
+  auto &pos = st.layout[st.page_num - 1].pos;
+  st.doc_x = pos.x() + int(st.page_frac_x * pos.width());
+  st.doc_x = std::clamp(st.doc_x, 0, get_max_doc_x(st));
+  st.doc_y = pos.y() + int(st.page_frac * pos.height());
+  st.doc_y = std::clamp(st.doc_y, 0, get_max_doc_y(st));
+  st.tiled = true;
+  st.pdf = None;
+  set_continuous_page(st, true);
+}
 
-  auto scale = dpi / 72.0;
-  return {dpi,
-          {x, y, w, h},
-          {int(x0 * scale), int(y0 * scale), int(width * scale),
-           int(height * scale)}};
+// The overview is a grid of thumbnails, each in a thumb_size square cell
+// with the page number below it.
+static int get_overview_columns(const AppState &st) {
+  return std::max(1, st.main_pos.width() / (thumb_size + thumb_gap));
 }
 
-static Pixmap render_pdf_page_to_pixmap(const AppState &st,
-                                        const PdfRenderConf &prc) {
+static int get_overview_row_height(const AppState &st) {
+  return thumb_size + st.fheight + thumb_gap;
+}
 
-  auto img = st.renderer->render_page(st.page, prc.dpi, prc.dpi, prc.crop.x(),
-                                      prc.crop.y(), prc.crop.width(),
-                                      prc.crop.height());
-  auto xim = XCreateImage(
-      st.display, DefaultVisual(st.display, DefaultScreen(st.display)), 24,
-      ZPixmap, 0, img.data(), img.width(), img.height(), 32, 0);
+// The thumbnail cell of page n on screen.
+static srect get_overview_cell(const AppState &st, int n) {
+  int cols = get_overview_columns(st);
+  int x = (st.main_pos.width() - cols * (thumb_size + thumb_gap) + thumb_gap) / 2;
+  return {x + (n - 1) % cols * (thumb_size + thumb_gap),
+          thumb_gap + (n - 1) / cols * get_overview_row_height(st) -
+              st.overview_y,
+          thumb_size, thumb_size};
+}
+
+// First and last pages of the overview with a cell in area.
+static std::pair<int, int> get_overview_pages(const AppState &st,
+                                              const srect &area) {
+  int cols = get_overview_columns(st);
+  int h = get_overview_row_height(st);
+  int first = std::max(0, (st.overview_y + area.y() - thumb_gap) / h);
+  int last = std::max(0, (st.overview_y + area.bottom() - thumb_gap) / h);
+  return {std::min(first * cols + 1, st.doc->pages()),
+          std::min((last + 1) * cols, st.doc->pages())};
+}
 
-  Pixmap pxm = XCreatePixmap(
-      st.display, DefaultRootWindow(st.display), img.width(), img.height(),
-      DefaultDepth(st.display, DefaultScreen(st.display)));
+static int get_max_overview_y(const AppState &st) {
+  int rows = (st.doc->pages() + get_overview_columns(st) - 1) /
+             get_overview_columns(st);
+  return std::max(0, thumb_gap + rows * get_overview_row_height(st) -
+                         st.main_pos.height());
+}
 
-  XPutImage(st.display, pxm, DefaultGC(st.display, DefaultScreen(st.display)),
-            xim, 0, 0, 0, 0, img.width(), img.height());
+// The render of the thumbnail of page n, fitted to its cell.
+static PdfRenderConf get_thumb_conf(const AppState &st, int n) {
+  return get_pdf_render_conf(true, false, 0, {0, 0, thumb_size, thumb_size},
+                             st.page_rects[n - 1], false, {}, st.rotation, 1);
+}
 
-  xim->data = NULL;
-  XDestroyImage(xim);
+static bool is_thumb(const AppState &st, const RenderKey &k) {
+  return k.page >= 1 && k.page <= int(st.page_rects.size()) &&
+         k == get_render_key(st, k.page, get_thumb_conf(st, k.page));
+}
 
-  return pxm;
+// Scrolls the grid to have the current page in view.
+static void relayout_overview(AppState &st) {
+  measure_pages(st);
+  if (!st.atlas)
+    st.atlas = std::make_unique<ThumbAtlas>(st.display, thumb_size,
+                                            thumb_slots);
+
+  auto cell = get_overview_cell(st, st.page_num);
+  int bottom = cell.y() + get_overview_row_height(st);
+  if (cell.y() < thumb_gap)
+    st.overview_y += cell.y() - thumb_gap;
+  else if (bottom > st.main_pos.height())
+    st.overview_y += bottom - st.main_pos.height();
+  st.overview_y = std::clamp(st.overview_y, 0, get_max_overview_y(st));
+  st.tiled = true;
+  st.pdf = None;
 }
 
-static void copy_pixmap_on_expose_event(const AppState &st, const srect &prev,
-                                        const XExposeEvent &e) {
-  if (st.pdf_pos != prev) {
-    std::vector<srect> diff = subtract(prev, st.pdf_pos);
-    for (size_t i = 0; i < diff.size(); ++i) {
-      XClearArea(st.display, st.main, diff[i].x(), diff[i].y(), diff[i].width(),
-                 diff[i].height(), False);
+// Adds the jobs needed to have area covered by the render of page at prc.
+static void add_render_jobs(const AppState &st, int page,
+                            const PdfRenderConf &prc, const srect &area,
+                            RenderPriority priority,
+                            std::vector<RenderJob> &jobs) {
+  std::vector<PdfRenderConf> tiles{prc};
+  if (st.tiled)
+    tiles = get_tiles(prc, area, tile_size);
+
+  for (auto &t : tiles) {
+    auto key = get_render_key(st, page, t);
+    if (!st.cache->contains(key))
+      jobs.push_back({key, t, priority});
+  }
+}
+
+// Queues the full renders of what is shown as a preview, the tiles just
+// outside of the window, then the first screen of the neighbouring pages.
+static void prefetch(AppState &st) {
+  std::vector<RenderJob> jobs;
+  if (st.overview) {
+    // Visible thumbnails first, then a screen below and one above.
+    auto view = get_view(st);
+    int h = view.height();
+    auto priority = RenderPriority::visible;
+    for (auto &area : {view, srect{0, h, view.width(), h},
+                       srect{0, -h, view.width(), h}}) {
+      auto [first, last] = get_overview_pages(st, area);
+      for (int n = first; n <= last; ++n) {
+        auto prc = get_thumb_conf(st, n);
+        auto key = get_render_key(st, n, prc);
+        if (!st.atlas->get(key))
+          jobs.push_back({key, prc, priority});
+      }
+      priority = RenderPriority::background;
+    }
+    st.pool->prefetch(jobs);
+    return;
+  }
+
+  if (is_continuous(st)) {
+    auto priority = RenderPriority::visible;
+    for (auto &area : {get_view(st), get_view(st).padded(tile_margin)}) {
+      auto [first, last] = get_visible_pages(st, area);
+      for (int n = first; n <= last; ++n)
+        add_render_jobs(st, n, get_continuous_conf(st, n), area, priority,
+                        jobs);
+      priority = RenderPriority::nearby;
+    }
+    st.pool->prefetch(jobs);
+    return;
+  }
+
+  add_render_jobs(st, st.page_num, get_pdf_conf(st), get_view(st),
+                  RenderPriority::visible, jobs);
+  if (st.tiled)
+    add_render_jobs(st, st.page_num, get_pdf_conf(st),
+                    get_view(st).padded(tile_margin), RenderPriority::nearby,
+                    jobs);
+
+  for (int d = 1; d <= prefetch_depth && !st.magnifying; ++d) {
+    for (int n : {st.page_num + d, st.page_num - d}) {
+      if (n < 1 || n > st.doc->pages())
+        continue;
+
+      auto page = st.page_cache->get(n);
+      if (!page)
+        continue;
+
+      auto prc =
+          get_pdf_render_conf(st.fit_page, n < st.page_num, 0, st.main_pos,
+                              page, false, {}, st.rotation, st.zoom);
+      add_render_jobs(st, n, prc, get_view(st),
+                      d == 1 ? RenderPriority::nearby
+                             : RenderPriority::background,
+                      jobs);
+    }
+  }
+  st.pool->prefetch(jobs);
+}
+
+// Fills r of the back buffer with the background color.
+static void clear_area(AppState &st, const srect &r) {
+  XFillRectangle(st.display, st.back, st.back_gc, r.x(), r.y(), r.width(),
+                 r.height());
+}
+
+static void copy_pdf_area(AppState &st, const srect &dirty) {
+  GC gc = DefaultGC(st.display, DefaultScreen(st.display));
+  if (!st.tiled && st.pdf == None) {
+    clear_area(st, dirty);
+    return;
+  }
+  if (!st.tiled) {
+    XCopyArea(st.display, st.pdf, st.back, gc, dirty.x() - st.pdf_pos.x(),
+              dirty.y() - st.pdf_pos.y(), dirty.width(), dirty.height(),
+              dirty.x(), dirty.y());
+    return;
+  }
+
+  for (auto &t : get_tiles(get_pdf_conf(st), dirty, tile_size)) {
+    Pixmap pxm = get_cached_pixmap(st, st.page_num, st.page, t);
+    auto r = intersect(dirty, t.pos);
+    if (pxm == None) {
+      clear_area(st, r);
+      continue;
+    }
+    XCopyArea(st.display, pxm, st.back, gc, r.x() - t.pos.x(),
+              r.y() - t.pos.y(), r.width(), r.height(), r.x(), r.y());
+  }
+}
+
+// Draws the pages of the continuous layout found in area and clears what is
+// around them.
+static void copy_continuous_area(AppState &st, const srect &area) {
+  GC gc = DefaultGC(st.display, DefaultScreen(st.display));
+  auto clear = [&st](int x, int y, int w, int h) {
+    if (w > 0 && h > 0)
+      clear_area(st, {x, y, w, h});
+  };
+
+  auto [first, last] = get_visible_pages(st, area);
+  int y = area.y();
+  for (int n = first; n <= last; ++n) {
+    auto prc = get_continuous_conf(st, n);
+    auto dirty = intersect(area, prc.pos);
+    if (is_invalid(dirty) || dirty.width() == 0 || dirty.height() == 0)
+      continue;
+
+    clear(area.x(), y, area.width(), dirty.y() - y);
+    clear(area.x(), dirty.y(), dirty.x() - area.x(), dirty.height());
+    clear(dirty.right(), dirty.y(), area.right() - dirty.right(),
+          dirty.height());
+    y = dirty.bottom();
+
+    auto page = get_page(st, n);
+    for (auto &t : get_tiles(prc, dirty, tile_size)) {
+      Pixmap pxm = get_cached_pixmap(st, n, page, t);
+      auto r = intersect(dirty, t.pos);
+      if (pxm == None) {
+        clear(r.x(), r.y(), r.width(), r.height());
+        continue;
+      }
+      XCopyArea(st.display, pxm, st.back, gc, r.x() - t.pos.x(),
+                r.y() - t.pos.y(), r.width(), r.height(), r.x(), r.y());
+    }
+  }
+  clear(area.x(), y, area.width(), area.bottom() - y);
+}
+
+// Draws the thumbnails in area, outlining the ones still being rendered, and
+// the number of each page below it.
+static void copy_overview_area(AppState &st, const srect &area) {
+  if (area.width() == 0 || area.height() == 0)
+    return;
+
+  GC gc = DefaultGC(st.display, DefaultScreen(st.display));
+  clear_area(st, area);
+
+  auto [first, last] = get_overview_pages(st, area);
+  for (int n = first; n <= last; ++n) {
+    auto cell = get_overview_cell(st, n);
+    auto prc = get_thumb_conf(st, n);
+    srect thumb{cell.x() + (thumb_size - prc.crop.width()) / 2,
+                cell.y() + (thumb_size - prc.crop.height()) / 2,
+                prc.crop.width(), prc.crop.height()};
+
+    auto src = st.atlas->get(get_render_key(st, n, prc));
+    auto r = intersect(area, thumb);
+    if (src && !is_invalid(r))
+      XCopyArea(st.display, st.atlas->pixmap(), st.back, gc,
+                src->x() + r.x() - thumb.x(), src->y() + r.y() - thumb.y(),
+                r.width(), r.height(), r.x(), r.y());
+    if (!src || n == st.page_num) {
+      auto o = n == st.page_num ? thumb.padded(2) : thumb;
+      XDrawRectangle(st.display, st.back, st.text_gc, o.x(), o.y(),
+                     o.width() - 1, o.height() - 1);
     }
+
+    auto label = std::to_string(n);
+    int w = Xutf8TextEscapement(st.fset, label.c_str(), label.size());
+    Xutf8DrawString(st.display, st.back, st.fset, st.text_gc,
+                    cell.x() + (thumb_size - w) / 2,
+                    cell.bottom() + st.fheight - st.fbase, label.c_str(),
+                    label.size());
+  }
+}
+
+static std::string get_search_status(const AppState &st) {
+  if (!st.search || st.prompt.substr(0, 6) != "search")
+    return "";
+
+  char buf[96];
+  if (st.search->done())
+    snprintf(buf, sizeof(buf), "  [%zu hits]", st.search->count());
+  else
+    snprintf(buf, sizeof(buf), "  [%zu hits, %d/%d pages]",
+             st.search->count(), st.search->scanned(), st.doc->pages());
+  return buf;
+}
+
+// Outlines every match on the page but the current one, which is shown as the
+// selection.
+static void draw_search_hits(const AppState &st, const CoordConv &cc,
+                             const srect &area) {
+  XRectangle clip{short(area.x()), short(area.y()),
+                  (unsigned short)area.width(), (unsigned short)area.height()};
+  XSetClipRectangles(st.display, st.selection_gc, 0, 0, &clip, 1, Unsorted);
+
+  for (size_t off : st.search->hits(st.page_num)) {
+    if (st.searching && st.match_page == st.page_num && off == st.match)
+      continue;
+
+    auto r = cc.to_screen(
+        st.index->match_rect(st.page_num, off, st.search->query.size()));
+    XDrawRectangle(st.display, st.back, st.selection_gc, r.x(), r.y(),
+                   r.width(), r.height());
   }
 
-  srect dirty = intersect(srect{e.x, e.y, e.width, e.height}, st.pdf_pos);
-  if (!is_invalid(dirty)) {
-    XCopyArea(st.display, st.pdf, st.main,
-              DefaultGC(st.display, DefaultScreen(st.display)),
-              dirty.x() - st.pdf_pos.x(), dirty.y() - st.pdf_pos.y(),
-              dirty.width(), dirty.height(), dirty.x(), dirty.y());
+  XSetClipMask(st.display, st.selection_gc, None);
+}
+
+// The selection being dragged, limited to the page and kept off the status
+// bar so that inverting it never touches anything drawn on top.
+static srect get_band(const AppState &st) {
+  int h = st.status ? st.status_pos.y() : st.main_pos.height();
+  auto r = intersect(intersect(st.selection.normalized(), st.pdf_pos),
+                     srect{0, 0, st.main_pos.width(), h});
+  return st.selecting && !is_invalid(r) ? r : srect{0, 0, 0, 0};
+}
+
+static void redraw_area(AppState &st, const srect &area) {
+  auto view = intersect(area, get_view(st));
+  if (st.overview && !is_invalid(view))
+    copy_overview_area(st, view);
+  else if (is_continuous(st) && !is_invalid(view))
+    copy_continuous_area(st, view);
+
+  srect dirty = intersect(area, st.pdf_pos);
+  if (!st.overview && !is_invalid(dirty)) {
+    if (!is_continuous(st))
+      copy_pdf_area(st, dirty);
 
     const CoordConv cc(st.page, st.pdf_pos, false, st.rotation);
-    srect rs = st.selecting ? st.selection.normalized()
-                            : cc.to_screen(st.pdf_selection);
+    srect rs = st.selecting ? get_band(st) : cc.to_screen(st.pdf_selection);
     if (rs.width() > 0 && rs.height() > 0) {
-      dirty = intersect(srect{e.x, e.y, e.width, e.height}, rs);
-      if (!is_invalid(dirty))
-        XFillRectangle(st.display, st.main, st.selection_gc, dirty.x(),
-                       dirty.y(), dirty.width(), dirty.height());
+      auto sel = intersect(area, rs);
+      if (!is_invalid(sel))
+        XFillRectangle(st.display, st.back, st.selection_gc, sel.x(),
+                       sel.y(), sel.width(), sel.height());
     }
+
+    if (st.search)
+      draw_search_hits(st, cc, dirty);
   }
 
   if (st.status) {
-    if (is_invalid(
-            intersect(srect{e.x, e.y, e.width, e.height}, st.status_pos)))
+    if (is_invalid(intersect(area, st.status_pos)))
       return;
 
-    XFillRectangle(st.display, st.main, st.status_gc, st.status_pos.x(),
+    XFillRectangle(st.display, st.back, st.status_gc, st.status_pos.x(),
                    st.status_pos.y(), st.status_pos.width(),
                    st.status_pos.height());
 
-    std::string str{st.prompt + st.value + "_"};
+    std::string str{st.prompt + st.value + "_" + get_search_status(st)};
     if (!st.input)
       str = st.prompt;
-    Xutf8DrawString(st.display, st.main, st.fset, st.text_gc,
+    Xutf8DrawString(st.display, st.back, st.fset, st.text_gc,
                     st.status_pos.x() + 1,
                     st.status_pos.y() + st.status_pos.height() - (st.fbase + 1),
                     str.c_str(), str.size());
   }
 }
 
-static void force_render_page(AppState &st, bool clear = true) {
-  if (st.pdf != None && clear) {
-    XFreePixmap(st.display, st.pdf);
-    st.pdf = None;
+// Adds r to areas, merged with the ones it overlaps. Past a handful of areas
+// they are all merged into one.
+static void add_area(std::vector<srect> &areas, const srect &r) {
+  if (is_invalid(r) || r.width() <= 0 || r.height() <= 0)
+    return;
+
+  auto merge = [](const srect &a, const srect &b) {
+    int x = std::min(a.x(), b.x()), y = std::min(a.y(), b.y());
+    return srect{x, y, std::max(a.right(), b.right()) - x,
+                 std::max(a.bottom(), b.bottom()) - y};
+  };
+
+  srect u = r;
+  for (size_t i = 0; i < areas.size();) {
+    if (is_invalid(intersect(areas[i], u))) {
+      ++i;
+      continue;
+    }
+    u = merge(u, areas[i]);
+    areas.erase(areas.begin() + i);
+    i = 0;
   }
+  areas.push_back(u);
+
+  if (areas.size() > 8) {
+    for (auto &d : areas)
+      u = merge(u, d);
+    areas = {u};
+  }
+}
 
+// Adds r to what the next repaint draws.
+static void damage(AppState &st, const srect &r) { add_area(st.damage, r); }
+
+// Makes the window show the back buffer again in r.
+static void expose(AppState &st, const srect &r) { add_area(st.exposed, r); }
+
+// Makes the back buffer the size of the window, empty.
+static void resize_back_buffer(AppState &st) {
   XWindowAttributes attrs;
   XGetWindowAttributes(st.display, st.main, &attrs);
+  if (st.back != None)
+    XFreePixmap(st.display, st.back);
+  st.back = XCreatePixmap(st.display, st.main, attrs.width, attrs.height,
+                          attrs.depth);
+  clear_area(st, get_view(st));
+}
 
-  XEvent e;
-  e.type = ConfigureNotify;
-  e.xconfigure.x = attrs.x;
-  e.xconfigure.y = attrs.y;
-  e.xconfigure.width = attrs.width;
-  e.xconfigure.height = attrs.height;
-  XSendEvent(st.display, st.main, False, StructureNotifyMask, &e);
-
-  e.type = Expose;
-  e.xexpose.x = 0;
-  e.xexpose.y = 0;
-  e.xexpose.width = attrs.width;
-  e.xexpose.height = attrs.height;
-  XSendEvent(st.display, st.main, False, ExposureMask, &e);
-}
-
-static void send_expose(const AppState &st, const srect &r) {
-  XEvent e;
-  e.type = Expose;
-  e.xexpose.x = r.x();
-  e.xexpose.y = r.y();
-  e.xexpose.width = r.width();
-  e.xexpose.height = r.height();
-  XSendEvent(st.display, st.main, False, ExposureMask, &e);
+static void force_render_page(AppState &st, bool clear = true) {
+  if (clear)
+    st.relayout = true;
+  st.prefetch = true;
+  damage(st, {0, 0, st.main_pos.width(), st.main_pos.height()});
+}
+
+// Turns the pages clockwise by degrees. A full render of the current page is
+// turned on our side instead of going through poppler on this thread. When
+// the new layout gives it the turned size, as with 180 degrees or a fixed
+// zoom, it is the new render. Otherwise, as with quarter turns in fit page
+// mode, it is scaled into a preview while the render pool renders the exact
+// size. Tiled and continuous layouts are rendered again.
+static void rotate_view(AppState &st, int degrees) {
+  auto old_conf = st.pdf_conf;
+  auto old_key = get_render_key(st, st.page_num, old_conf);
+  bool reuse = st.pdf != None && !st.tiled && !st.overview &&
+               !is_continuous(st) && st.cache->contains(old_key);
+  st.rotation = (st.rotation + degrees) % 360;
+
+  if (reuse) {
+    auto prc = get_pdf_render_conf(st.fit_page, false, 0, st.main_pos,
+                                   st.page, st.magnifying, st.magnify,
+                                   st.rotation, st.zoom);
+    auto key = get_render_key(st, st.page_num, prc);
+    int w = prc.crop.width(), h = prc.crop.height();
+    if (!st.cache->contains(key) && w > 0 && h > 0) {
+      auto img = st.uploader->download(st.pdf, old_conf.crop.width(),
+                                       old_conf.crop.height());
+      if (img.is_valid()) {
+        img = rotate_image(img, degrees);
+        bool exact = img.width() == w && img.height() == h;
+        if (!exact)
+          img = scale_image(img, w, h);
+        st.cache->put(key, upload_image(st, img), size_t(w) * h * 4, !exact);
+      }
+    }
+  }
+  force_render_page(st, true);
+}
+
+// Where the render for k is shown on screen, invalid if it is not.
+static srect get_screen_area(const AppState &st, const RenderKey &k) {
+  srect invalid{-1, -1, -1, -1};
+  PdfRenderConf prc;
+  if (is_continuous(st)) {
+    if (k.page < 1 || k.page > int(st.layout.size()))
+      return invalid;
+    prc = get_continuous_conf(st, k.page);
+  } else {
+    if (k.page != st.page_num)
+      return invalid;
+    prc = get_pdf_conf(st);
+  }
+  if (k.dpi != prc.dpi || k.rotation != prc.rotation)
+    return invalid;
+
+  srect r{prc.pos.x() + k.crop.x() - prc.crop.x(),
+          prc.pos.y() + k.crop.y() - prc.crop.y(), k.crop.width(),
+          k.crop.height()};
+  return intersect(r, get_view(st));
+}
+
+// Takes the page sizes read since last time and lays out again if they
+// differ from what was assumed.
+static void collect_page_sizes(AppState &st) {
+  if (st.sizes && st.sizes->take(st.page_rects) &&
+      (st.overview || is_continuous(st)))
+    force_render_page(st);
+}
+
+static void collect_prefetched_pages(AppState &st) {
+  for (auto &r : st.pool->collect()) {
+    if (is_thumb(st, r.key)) {
+      Pixmap pxm = upload_image(st, r.img);
+      st.atlas->put(r.key, pxm, r.img.width(), r.img.height());
+      XFreePixmap(st.display, pxm);
+      if (st.overview)
+        damage(st, get_overview_cell(st, r.key.page));
+      continue;
+    }
+
+    if (st.cache->contains(r.key))
+      continue;
+
+    add_render_time(st, r.key.page, r.ms);
+    Pixmap pxm = upload_image(st, r.img);
+    st.cache->put(r.key, pxm, size_t(r.img.width()) * r.img.height() * 4);
+
+    // A render on screen replaces a preview, which was just freed, or the
+    // blank left when it was deferred.
+    if (!st.tiled && r.key == get_render_key(st, st.page_num, st.pdf_conf))
+      st.pdf = pxm;
+    auto area = get_screen_area(st, r.key);
+    if (!is_invalid(area))
+      damage(st, area);
+  }
 }
 
 static int get_pdf_scroll_diff(const AppState &st, double percent) {
@@ -345,14 +1071,371 @@ static int get_pdf_scroll_diff(const AppState &st, double percent) {
   if (sc > 0)
     return std::min(sc, -st.pdf_pos.y());
 
-  // As we scroll down the top decreases from zero, so the srect is actually
-  // getting BIGGER.
-  // TODO Fix this!
-  int h = st.pdf_pos.bottom() + st.pdf_pos.top();
-  if (h <= st.main_pos.height()) {
+  int below = st.pdf_pos.bottom() - st.main_pos.height();
+  if (below <= 0)
     return 0;
+  return -std::min(-sc, below);
+}
+
+// Same as get_pdf_scroll_diff(), sideways.
+static int get_pdf_scroll_dx(const AppState &st, double percent) {
+  if (st.pdf_pos.width() <= st.main_pos.width())
+    return 0;
+
+  int sc = st.pdf_pos.width() * percent;
+  if (sc > 0)
+    return std::min(sc, -st.pdf_pos.x());
+  return -std::min(-sc, st.pdf_pos.right() - st.main_pos.width());
+}
+
+// Shifts the window contents by dx, dy pixels on the next repaint. Scrolls
+// coming in a burst add up to a single move, damage not drawn yet moves
+// along.
+static void blit_scroll(AppState &st, int dx, int dy) {
+  for (auto &d : st.damage)
+    d = {d.x() + dx, d.y() + dy, d.width(), d.height()};
+  st.scroll_dx += dx;
+  st.scroll_dy += dy;
+  st.prefetch = true;
+}
+
+// What stays visible is moved within the back buffer and only the uncovered
+// strips are drawn again, without any round trip.
+static void apply_scroll(AppState &st) {
+  int dx = st.scroll_dx, dy = st.scroll_dy;
+  st.scroll_dx = st.scroll_dy = 0;
+  if (dx == 0 && dy == 0)
+    return;
+
+  int w = st.main_pos.width();
+  int h = st.status ? st.status_pos.y() : st.main_pos.height();
+  int kept_w = w - std::abs(dx), kept_h = h - std::abs(dy);
+  if (st.selecting || kept_w <= 0 || kept_h <= 0) {
+    damage(st, {0, 0, w, h});
+    return;
   }
-  return -std::min(-sc, h - st.main_pos.height());
+
+  XCopyArea(st.display, st.back, st.back, st.back_gc, std::max(0, -dx),
+            std::max(0, -dy), kept_w, kept_h, std::max(0, dx),
+            std::max(0, dy));
+  for (auto &strip : subtract(srect{0, 0, w, h}, srect{dx, dy, w, h})) {
+    clear_area(st, strip);
+    damage(st, strip);
+  }
+  expose(st, {0, 0, w, h});
+}
+
+// Moves the page by dx, dy pixels.
+static void scroll_pdf(AppState &st, int dx, int dy) {
+  TraceSpan span("scroll");
+  st.pdf_pos = {st.pdf_pos.x() + dx, st.pdf_pos.y() + dy, st.pdf_pos.width(),
+                st.pdf_pos.height()};
+  blit_scroll(st, dx, dy);
+}
+
+// Moves the document by a fraction of the current page height, stopping at
+// either end of it.
+static void scroll_continuous(AppState &st, double percent) {
+  TraceSpan span("scroll");
+  int y = st.doc_y - int(st.pdf_pos.height() * percent);
+  y = std::clamp(y, 0, get_max_doc_y(st));
+  int diff = st.doc_y - y;
+  if (diff == 0)
+    return;
+
+  st.doc_y = y;
+  set_continuous_page(st);
+  blit_scroll(st, 0, diff);
+}
+
+// Moves the page (or the document in continuous mode) sideways by a fraction
+// of the page width, when it is wider than the window.
+static void scroll_sideways(AppState &st, double percent) {
+  if (st.overview)
+    return;
+  if (!is_continuous(st)) {
+    int dx = get_pdf_scroll_dx(st, percent);
+    if (dx != 0)
+      scroll_pdf(st, dx, 0);
+    return;
+  }
+
+  TraceSpan span("scroll");
+  int x = st.doc_x - int(st.pdf_pos.width() * percent);
+  x = std::clamp(x, 0, get_max_doc_x(st));
+  int diff = st.doc_x - x;
+  if (diff == 0)
+    return;
+
+  st.doc_x = x;
+  set_continuous_page(st);
+  blit_scroll(st, diff, 0);
+}
+
+// Moves the overview grid by diff pixels.
+static void scroll_overview(AppState &st, int diff) {
+  TraceSpan span("scroll");
+  int y = std::clamp(st.overview_y - diff, 0, get_max_overview_y(st));
+  diff = st.overview_y - y;
+  if (diff == 0)
+    return;
+
+  st.overview_y = y;
+  blit_scroll(st, 0, diff);
+}
+
+// Remembers where we are for BACK.
+static void push_location(AppState &st) {
+  st.page_stack.push({st.page_num, st.pdf_pos.y()});
+}
+
+// Shows the window as it was when the zoom started, scaled on the server.
+static void draw_zoom_preview(AppState &st) {
+  if (st.zoom_src_pic == None)
+    return;
+
+  TraceSpan span("zoom_preview");
+  double s = st.zoom_target / st.zoom;
+  XTransform t{{{XDoubleToFixed(1 / s), 0, XDoubleToFixed(-st.zoom_x / s)},
+                {0, XDoubleToFixed(1 / s), XDoubleToFixed(-st.zoom_y / s)},
+                {0, 0, XDoubleToFixed(1)}}};
+  XRenderSetPictureTransform(st.display, st.zoom_src_pic, &t);
+
+  srect view{0, 0, st.main_pos.width(),
+             st.status ? st.status_pos.y() : st.main_pos.height()};
+  srect scaled{int(st.zoom_x), int(st.zoom_y), int(st.main_pos.width() * s),
+               int(st.main_pos.height() * s)};
+  auto r = intersect(view, scaled);
+  if (!is_invalid(r))
+    XRenderComposite(st.display, PictOpSrc, st.zoom_src_pic, None,
+                     st.zoom_dst_pic, r.x(), r.y(), 0, 0, r.x(), r.y(),
+                     r.width(), r.height());
+  for (auto &c : subtract(view, scaled))
+    XFillRectangle(st.display, st.main, st.back_gc, c.x(), c.y(), c.width(),
+                   c.height());
+}
+
+// Scales the view by factor around x, y. The window is scaled on the server
+// right away, pages are rendered at the new zoom once input settles. Without
+// XRender the window is left as is until then.
+static void zoom_view(AppState &st, double factor, int x, int y) {
+  if (st.overview || st.magnifying)
+    return;
+
+  if (!st.zooming) {
+    XWindowAttributes attrs;
+    XGetWindowAttributes(st.display, st.main, &attrs);
+    st.zoom_src = XCreatePixmap(st.display, st.main, attrs.width,
+                                attrs.height, attrs.depth);
+    XCopyArea(st.display, st.back, st.zoom_src, st.back_gc, 0, 0, attrs.width,
+              attrs.height, 0, 0);
+
+    int event_base, error_base;
+    auto format = XRenderQueryExtension(st.display, &event_base, &error_base)
+                      ? XRenderFindVisualFormat(st.display, attrs.visual)
+                      : NULL;
+    if (format) {
+      st.zoom_src_pic =
+          XRenderCreatePicture(st.display, st.zoom_src, format, 0, NULL);
+      st.zoom_dst_pic =
+          XRenderCreatePicture(st.display, st.main, format, 0, NULL);
+      XRenderSetPictureFilter(st.display, st.zoom_src_pic, FilterBilinear,
+                              NULL, 0);
+    }
+
+    st.zoom_target = st.zoom;
+    st.zoom_x = st.zoom_y = 0;
+    st.zooming = true;
+  }
+
+  double target = std::clamp(st.zoom_target * factor, zoom_min, zoom_max);
+  double f = target / st.zoom_target;
+  st.zoom_x = x + f * (st.zoom_x - x);
+  st.zoom_y = y + f * (st.zoom_y - y);
+  st.zoom_target = target;
+  st.zoom_deadline = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(zoom_settle_ms);
+  draw_zoom_preview(st);
+}
+
+// Ends the zoom gesture. Pages are laid out again at the new zoom, with what
+// was at the top left of the preview kept in place.
+static void finish_zoom(AppState &st) {
+  if (!st.zooming)
+    return;
+
+  double s = st.zoom_target / st.zoom;
+  if (is_continuous(st)) {
+    int left = int(-st.zoom_x / s), top = int(-st.zoom_y / s);
+    int n = get_visible_pages(st, {0, top, 1, 1}).first;
+    auto &pos = st.layout[n - 1].pos;
+    set_page(st, n);
+    st.page_frac_x = double(st.doc_x + left - pos.x()) / pos.width();
+    st.page_frac = double(st.doc_y + top - pos.y()) / pos.height();
+  } else {
+    st.next_pos = srect{int(st.zoom_x + st.pdf_pos.x() * s),
+                        int(st.zoom_y + st.pdf_pos.y() * s), 0, 0};
+  }
+  st.zoom = st.zoom_target;
+
+  if (st.zoom_src_pic != None) {
+    XRenderFreePicture(st.display, st.zoom_src_pic);
+    XRenderFreePicture(st.display, st.zoom_dst_pic);
+  }
+  XFreePixmap(st.display, st.zoom_src);
+  st.zoom_src = None;
+  st.zoom_src_pic = st.zoom_dst_pic = None;
+  st.zooming = false;
+  force_render_page(st);
+}
+
+// How long the event loop may wait for input before the zoom settles, -1
+// when not zooming.
+static int get_event_timeout(const AppState &st) {
+  if (!st.zooming)
+    return -1;
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      st.zoom_deadline - std::chrono::steady_clock::now());
+  return std::max(0, int(left.count()));
+}
+
+// Sleeps until the X server sends something, a background thread is done or
+// timeout_ms passed (-1 waits as long as it takes). Returns whether a
+// background thread woke us up.
+static bool wait_for_events(const AppState &st, int timeout_ms) {
+  // Also flushes the requests of the last repaint before sleeping.
+  if (XPending(st.display))
+    timeout_ms = 0;
+
+  pollfd fds[] = {{ConnectionNumber(st.display), POLLIN, 0},
+                  {st.wake_fd, POLLIN, 0}};
+  poll(fds, 2, timeout_ms);
+
+  uint64_t n;
+  return read(st.wake_fd, &n, sizeof(n)) == sizeof(n);
+}
+
+// Lays the pages out for the current mode, window size and position.
+static void relayout(AppState &st) {
+  st.relayout = false;
+  st.prefetch = true;
+  if (st.overview) {
+    relayout_overview(st);
+    return;
+  }
+  if (is_continuous(st)) {
+    relayout_continuous(st);
+    return;
+  }
+
+  auto prc = get_pdf_render_conf(st.fit_page, st.scrolling_up, st.next_pos_y,
+                                 st.main_pos, st.page, st.magnifying,
+                                 st.magnify, st.rotation, st.zoom);
+  if (st.next_pos)
+    prc.pos = place_page({st.next_pos->x(), st.next_pos->y(),
+                          prc.pos.width(), prc.pos.height()},
+                         get_view(st));
+  st.scrolling_up = false;
+  st.next_pos_y = 0;
+  st.next_pos.reset();
+
+  // Large renders are split in tiles so only the visible part is
+  // rasterized and no pixmap goes over the X11 size limit.
+  st.tiled = !st.fit_page || st.magnifying || st.zoom != 1;
+  st.pdf_conf = prc;
+  st.pdf = None;
+  if (!st.tiled) {
+    st.pdf = get_cached_pixmap(st, st.page_num, st.page, prc);
+    st.cache->pin(get_render_key(st, st.page_num, prc));
+  }
+  st.pdf_pos = prc.pos;
+}
+
+// Inverts only what differs between the band on screen and the selection being
+// dragged, so a drag costs the same however many motion events it took. When
+// the whole view is drawn again anyway there is nothing to undo.
+static void update_band(AppState &st) {
+  auto band = get_band(st);
+  int h = st.status ? st.status_pos.y() : st.main_pos.height();
+  srect view{0, 0, st.main_pos.width(), h};
+  bool redrawn = std::any_of(st.damage.begin(), st.damage.end(),
+                             [&](auto &r) { return intersect(r, view) == view; });
+
+  auto invert = [&st](const srect &r) {
+    XFillRectangle(st.display, st.back, st.selection_gc, r.x(), r.y(),
+                   r.width(), r.height());
+    expose(st, r);
+  };
+  if (!redrawn && band != st.band) {
+    for (auto &r : subtract(st.band, band))
+      invert(r);
+    for (auto &r : subtract(band, st.band))
+      invert(r);
+  }
+  st.band = band;
+}
+
+// Brings the window up to date once all pending events were handled: lays
+// out again if needed, moves scrolled contents and draws the damaged areas
+// into the back buffer, then copies what changed to the window.
+static void repaint(AppState &st) {
+  if (st.zooming) {
+    if (!st.damage.empty() || !st.exposed.empty())
+      draw_zoom_preview(st);
+    st.damage.clear();
+    st.exposed.clear();
+    return;
+  }
+
+  TraceSpan span("repaint");
+  auto prev = st.pdf_pos;
+  if (st.relayout)
+    relayout(st);
+  if (st.pdf_pos != prev) {
+    for (auto &r : subtract(prev, st.pdf_pos)) {
+      clear_area(st, r);
+      expose(st, r);
+    }
+  }
+  apply_scroll(st);
+  update_band(st);
+
+  auto damaged = std::move(st.damage);
+  st.damage.clear();
+  for (auto &r : damaged) {
+    redraw_area(st, r);
+    expose(st, r);
+  }
+
+  for (auto &r : st.exposed)
+    XCopyArea(st.display, st.back, st.main, st.back_gc, r.x(), r.y(),
+              r.width(), r.height(), r.x(), r.y());
+  st.exposed.clear();
+
+  if (st.prefetch) {
+    prefetch(st);
+    st.prefetch = false;
+  }
+}
+
+// Page number followed by a summary of the last render, kept up to date while
+// it is shown.
+static std::string get_page_status(const AppState &st) {
+  auto &c = *st.cache;
+  unsigned lookups = c.hits + c.misses;
+  // Only shown while the page rendered last is still the one on screen.
+  char render[32] = "-";
+  if (st.render_page == st.page_num)
+    snprintf(render, sizeof(render), "%.0f ms", st.render_ms);
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+           "page %d/%d  zoom %.0f%%  render %s, cache %.0f%% hits %zu "
+           "MiB, upload %.1f ms (%s)",
+           st.page_num, st.doc->pages(), st.zoom * 100, render,
+           lookups ? 100.0 * c.hits / lookups : 0.0, c.bytes() >> 20,
+           st.uploader->last_ms(),
+           st.uploader->using_shm() ? "shm" : "XPutImage");
+  return buf;
 }
 
 static srect get_status_pos(const AppState &st) {
@@ -360,117 +1443,352 @@ static srect get_status_pos(const AppState &st) {
           st.fheight + 2};
 }
 
-static void search_text(AppState &st) {
-  poppler::page::search_direction_enum dir = poppler::page::search_next_result;
-  poppler::case_sensitivity_enum case_search = poppler::case_sensitive;
+static void cancel_search(AppState &st) {
+  bool searching = st.search != nullptr;
+  drop_searches(st);
+  if (!searching)
+    return;
+
+  st.searching = st.search_pending = false;
+  damage(st, intersect(get_view(st), st.pdf_pos));
+}
+
+// Moves to the next match as soon as it is known, called again as results
+// come in while it is not.
+static void jump_to_match(AppState &st) {
+  if (!st.search || !st.search_pending)
+    return;
+
+  // A query refined as it is typed stays on the current match as long as it
+  // still matches there.
+  std::optional<size_t> after;
+  if (st.searching && st.match_page == st.page_num) {
+    if (!st.search_refined)
+      after = st.match;
+    else if (st.search_backwards)
+      after = st.match + 1;
+    else if (st.match > 0)
+      after = st.match - 1;
+  }
+
+  bool pending;
+  auto hit =
+      st.search->next(st.page_num, after, st.search_backwards, pending);
+  if (pending)
+    return;
+
+  st.search_pending = st.search_refined = false;
+  damage(st, st.selection.normalized());
+  st.searching = bool(hit);
+  if (!hit) {
+    st.pdf_selection = {0, 0, 0, 0};
+    st.selection = {0, 0, 0, 0};
+    return;
+  }
+
+  if (hit->page != st.page_num) {
+    set_page(st, hit->page);
+    st.page_frac = 0;
+    force_render_page(st);
+  }
+
+  const CoordConv cc(st.page, st.pdf_pos, false, st.rotation);
+
+  st.match_page = hit->page;
+  st.match = hit->offset;
+  st.pdf_selection =
+      st.index->match_rect(hit->page, hit->offset, st.search->query.size());
+  st.selection = cc.to_screen(st.pdf_selection);
+  damage(st, st.selection.normalized());
+}
+
+static void update_search(AppState &st) {
+  if (!st.search)
+    return;
+
+  size_t hits = st.search->hits(st.page_num).size();
+  if (hits != st.search_hits_shown) {
+    st.search_hits_shown = hits;
+    damage(st, intersect(get_view(st), st.pdf_pos));
+  }
+
+  jump_to_match(st);
+  if (st.status)
+    damage(st, st.status_pos);
+}
+
+// Follows the query as it is typed: a search for it is started in the
+// background unless it is already known, and the view goes to its first
+// match. A longer query only checks the matches of the one before, a shorter
+// one goes back to the results kept for it. Scans for queries typed over are
+// stopped right away.
+static void update_query(AppState &st) {
+  TraceSpan span("update_query");
+  bool backwards = false;
+  bool icase = false;
   std::string str = st.value;
-  while (str.back() == '?' || str.back() == '~') {
+  while (!str.empty() && (str.back() == '?' || str.back() == '~')) {
     char flag = str.back();
     if (flag == '?')
-      dir = poppler::page::search_previous_result;
+      backwards = true;
     if (flag == '~')
-      case_search = poppler::case_insensitive;
+      icase = true;
     str.pop_back();
   }
+  if (str.empty()) {
+    cancel_search(st);
+    return;
+  }
 
-  bool found = false;
-  bool whole = false;
-  int page = st.page_num;
-
-  while (!whole) {
-    st.renderer->render_page(st.page, 72, 72, 0, false, true, false);
-    found = st.page->search(poppler::ustring::from_latin1(str), st.pos, dir,
-                            case_search);
-    /* found = tdev.takeText()->findText(search.data(), search.size(), */
-    /*                                   !st.searching, true, st.searching,
-     * false, */
-    /*                                   !ignore_case, backwards, whole_words,
-     */
-    /*                                   &st.left, &st.top, &st.right,
-     * &st.bottom); */
-
-    if (found)
-      break;
-
-    if (dir != poppler::page::search_next_result && page < st.doc->pages()) {
-      ++page;
-      st.searching = false;
-    } else if (dir == poppler::page::search_next_result && page > 1) {
-      --page;
-      st.searching = false;
-    } else {
-      whole = true;
-    }
+  // Typed text comes from XLookupString(), which is Latin-1.
+  std::u32string q(str.begin(), str.end());
+  for (auto &c : q)
+    c &= 0xff;
+
+  st.search_backwards = backwards;
+  if (st.search && st.search->query == q && st.search->icase == icase)
+    return;
+
+  if (st.search) {
+    st.search->cancel();
+    st.search_stack.push_back(std::move(st.search));
+  }
+  while (!st.search_stack.empty() &&
+         (st.search_stack.back()->icase != icase ||
+          !q.starts_with(st.search_stack.back()->query))) {
+    st.reaper->release(std::move(st.search_stack.back()));
+    st.search_stack.pop_back();
   }
 
-  if (found) {
-    if (page != st.page_num) {
-      st.page_num = page;
+  std::shared_ptr<Search> base;
+  if (!st.search_stack.empty()) {
+    base = st.search_stack.back();
+    if (base->query == q)
+      st.search_stack.pop_back();
+  }
 
-      st.page = st.doc->create_page(st.page_num);
-      (!st.page) &&
-          error("Cannot create page: " + std::to_string(st.page_num) + ".");
-      force_render_page(st);
-    }
+  if (base && base->query == q && base->done())
+    st.search = base;
+  else
+    st.search = std::make_shared<Search>(
+        st.index, get_opener(st), st.doc->pages(), st.page_num, backwards,
+        q, icase, [&st]() { wake_event_loop(st); }, base);
+  st.search_hits_shown = 0;
+  damage(st, intersect(get_view(st), st.pdf_pos));
+
+  st.search_pending = st.search_refined = true;
+  jump_to_match(st);
+}
 
-    const CoordConv cc(st.page, st.pdf_pos, false, st.rotation);
+// Goes to the match after the current one.
+static void search_text(AppState &st) {
+  auto prev = st.search;
+  update_query(st);
+  if (!st.search || st.search != prev)
+    return;
 
-    st.pdf_selection = st.pos;
-    st.selection = cc.to_screen(st.pdf_selection);
-  } else {
-    st.pdf_selection = {0, 0, 0, 0};
-    st.selection = {0, 0, 0, 0};
+  st.search_pending = true;
+  jump_to_match(st);
+}
+
+// Swaps in a version of the document loaded in the background. Renders of the
+// pages that did not change are kept and so is the position in the document,
+// the window is only drawn again if a page on screen changed.
+static void swap_document(AppState &st) {
+  auto r = st.watcher ? st.watcher->take() : std::nullopt;
+  if (!r)
+    return;
+
+  TraceSpan span("swap_document");
+  auto [first, last] = is_continuous(st)
+                           ? get_visible_pages(st, get_view(st))
+                           : std::pair(st.page_num, st.page_num);
+  bool visible = false;
+  for (int n : r->changed)
+    visible = visible || (n >= first && n <= last);
+
+  st.page_cache.reset();
+  st.doc = r->doc;
+  st.source->set(r->data);
+  st.page_cache = std::make_unique<PageCache>(st.doc.get(), page_cache_size);
+  st.cache->erase_pages(r->changed);
+  if (st.atlas)
+    st.atlas->erase_pages(r->changed);
+  st.pool->reload();
+  if (st.disk)
+    st.disk->set_document(get_document_id(*r->data));
+  drop_searches(st);
+  st.searching = st.search_pending = false;
+  st.index = make_index(st);
+
+  int pages = st.doc->pages();
+  if (st.page_num > pages) {
+    st.page_num = pages;
+    st.page_frac = 0;
+    visible = true;
+  }
+  set_page(st, st.page_num);
+
+  // Pages changing size move everything below them in continuous mode.
+  bool moved = false;
+  if (!st.page_rects.empty()) {
+    moved = int(st.page_rects.size()) != pages;
+    st.page_rects.resize(pages);
+    for (int n : r->changed) {
+      auto page = n <= pages ? st.page_cache->get(n) : NULL;
+      if (!page)
+        continue;
+      auto rect = page->page_rect();
+      auto &old = st.page_rects[n - 1];
+      moved = moved || rect.width() != old.width() ||
+              rect.height() != old.height();
+      old = rect;
+    }
+    // Sizes still being read come from the old version.
+    if (!st.sizes->done())
+      st.sizes = std::make_unique<PageSizes>(get_opener(st), pages,
+                                             [&st]() { wake_event_loop(st); });
   }
 
-  st.searching = found;
+  if (st.overview) {
+    force_render_page(st);
+  } else if (is_continuous(st)) {
+    if (moved)
+      force_render_page(st);
+    else if (visible)
+      damage(st, get_view(st));
+  } else if (visible) {
+    st.next_pos_y = st.pdf_pos.y();
+    force_render_page(st);
+  }
 }
 
 struct Args {
   std::string fname;
   Window root;
+  std::optional<ExportOptions> export_options;
+  bool export_text;
 };
 
 Args parse_args(int argc, char **argv) {
   std::string fname = "";
   Window root = None;
+  bool export_images = false, export_text = false;
+  ExportOptions o;
+
+  auto param = [&](int &i, const char *opt) -> std::string {
+    (i >= argc - 1) && error(std::string("Missing ") + opt + " parameter.");
+    return argv[++i];
+  };
 
   for (int i = 1; i < argc; ++i) {
-    if (std::string(argv[i]) == "-w") {
-      if (i < argc - 1) {
-        root = strtol(argv[++i], NULL, 0);
-        (root == 0) && error("Invalid window (-w) value.");
-      } else
-        error("Missing window (-w) parameter.");
+    std::string arg(argv[i]);
+    if (arg == "-w") {
+      root = strtol(param(i, "window (-w)").c_str(), NULL, 0);
+      (root == 0) && error("Invalid window (-w) value.");
+    } else if (arg == "-e") {
+      export_images = true;
+    } else if (arg == "-t") {
+      export_text = true;
+    } else if (arg == "-b") {
+      o.boxes = true;
+    } else if (arg == "-p") {
+      auto range = param(i, "pages (-p)");
+      char *end;
+      o.first = strtol(range.c_str(), &end, 10);
+      o.last = *end == '-' ? strtol(end + 1, &end, 10) : o.first;
+      (*end || o.first < 1 || o.last < o.first) &&
+          error("Invalid pages (-p) value.");
+    } else if (arg == "-d") {
+      o.dpi = strtod(param(i, "resolution (-d)").c_str(), NULL);
+      (o.dpi <= 0) && error("Invalid resolution (-d) value.");
+    } else if (arg == "-g") {
+      o.width = strtol(param(i, "geometry (-g)").c_str(), NULL, 10);
+      o.height = strtol(param(i, "geometry (-g)").c_str(), NULL, 10);
+      (o.width <= 0 || o.height <= 0) && error("Invalid geometry (-g) value.");
+    } else if (arg == "-f") {
+      auto format = param(i, "format (-f)");
+      (format != "png" && format != "ppm") &&
+          error("Invalid format (-f) value.");
+      o.png = format == "png";
+    } else if (arg == "-o") {
+      o.prefix = param(i, "output (-o)");
+    } else if (arg == "-j") {
+      o.threads = strtol(param(i, "threads (-j)").c_str(), NULL, 10);
+      (o.threads <= 0) && error("Invalid threads (-j) value.");
     } else
-      fname = std::string(argv[i]);
+      fname = arg;
   }
 
   if (fname == "")
     error(std::string("Missing pdf file, usage: ") + argv[0] +
-          " [-w window] pdf_file.");
+          " [-w window] pdf_file (- for standard input), or " + argv[0] +
+          " -e [-p first[-last]] [-d dpi | -g width height] [-f png|ppm] "
+          "[-o prefix] [-j threads] pdf_file, or " + argv[0] +
+          " -t [-b] [-p first[-last]] [-j threads] pdf_file.");
+
+  if (!export_images && !export_text)
+    return {fname, root, std::nullopt, false};
+  return {fname, root, o, export_text};
+}
 
-  return {fname, root};
+// Renders pages to image files, or writes their text to standard output,
+// without connecting to X.
+static void run_export(const std::string &file_name, ExportOptions o,
+                       bool text) {
+  auto source = std::make_shared<DocumentSource>(
+      read_document_data(file_name, map_size));
+  auto doc = source->open();
+  (!doc) && error("Cannot open document: " + file_name + ".");
+
+  if (o.last == 0)
+    o.last = doc->pages();
+  (o.last > doc->pages()) && error("Invalid pages (-p) value.");
+  DocumentOpener open = [source]() { return source->open(); };
+  if (text)
+    export_text(open, o, std::cout);
+  else
+    export_pages(open, o);
 }
 
 int main(int argc, char **argv) {
   setlocale(LC_ALL, "");
 
+  if (auto path = std::getenv("SPDF_TRACE"))
+    trace_open(path);
+
   AppState st;
   try {
     auto args = parse_args(argc, argv);
+    if (args.export_options) {
+      run_export(args.fname, *args.export_options, args.export_text);
+      return 0;
+    }
 
     std::string file_name(args.fname);
 
-    st.doc = std::unique_ptr<poppler::document>(
-        poppler::document::load_from_file(file_name));
+    st.source = std::make_shared<DocumentSource>(
+        read_document_data(file_name, map_size));
+    st.doc = st.source->open();
+    (!st.doc) && error("Cannot open document: " + file_name + ".");
+    st.file_name = file_name;
+    st.page_cache =
+        std::make_unique<PageCache>(st.doc.get(), page_cache_size);
+    st.index = make_index(st);
     st.renderer =
         std::unique_ptr<poppler::page_renderer>(new poppler::page_renderer());
-    st.renderer->set_render_hints(poppler::page_renderer::antialiasing |
-                                  poppler::page_renderer::text_antialiasing);
-
-    st.page_num = 1;
-    st.page = st.doc->create_page(st.page_num);
-    (!st.page) && error("Document has no pages.");
+    setup_renderer(*st.renderer);
+    st.preview_renderer = std::make_unique<poppler::page_renderer>();
+
+    (st.doc->pages() < 1) && error("Document has no pages.");
+    int page = 1, offset = 0;
+    if (disk_cache && file_name != "-" && !get_position_dir().empty() &&
+        load_position(get_position_dir(), file_name, page, offset) &&
+        page >= 1 && page <= st.doc->pages())
+      st.next_pos_y = offset;
+    else
+      page = 1;
+    set_page(st, page);
 
     auto rect = st.page->page_rect();
     auto xret = setup_x(rect.width(), rect.height(), file_name, args.root);
@@ -482,6 +1800,7 @@ int main(int argc, char **argv) {
     st.scrolling_up = false;
 
     st.selection_gc = xret.selection;
+    st.back_gc = xret.back;
     st.status_gc = xret.status;
     st.text_gc = xret.text;
 
@@ -489,14 +1808,53 @@ int main(int argc, char **argv) {
     st.fheight = xret.fheight;
     st.fbase = xret.fbase;
 
+    st.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    (st.wake_fd < 0) && error("Cannot create eventfd.");
+
+    XWindowAttributes attrs;
+    XGetWindowAttributes(st.display, st.main, &attrs);
+    st.main_pos = {attrs.x, attrs.y, attrs.width, attrs.height};
+    st.status_pos = get_status_pos(st);
+    resize_back_buffer(st);
+    st.cache = std::make_unique<PixmapCache>(st.display, cache_size);
+    st.uploader = std::make_unique<Uploader>(st.display);
+    if (disk_cache && !get_cache_dir().empty()) {
+      st.disk = std::make_unique<DiskCache>(get_cache_dir() + "/renders",
+                                            disk_cache_size);
+      st.disk->set_document(get_document_id(*st.source->get()));
+    }
+    st.reaper = std::make_unique<SearchReaper>();
+    st.pool = std::make_unique<RenderPool>(
+        get_opener(st), [&st]() { wake_event_loop(st); }, render_threads,
+        st.disk.get());
+    // Standard input cannot be read again.
+    if (file_name != "-")
+      st.watcher = std::make_unique<Watcher>(
+          [file_name]() { return read_document_data(file_name, map_size); },
+          st.source->get(), file_name, auto_reload, reload_delay_ms,
+          [&st]() { wake_event_loop(st); });
+
+    // Events are handled as they come and the window is repainted once they
+    // are all handled, before waiting for more.
     XEvent event;
     while (true) {
+      if (!XPending(st.display)) {
+        repaint(st);
+        if (wait_for_events(st, get_event_timeout(st))) {
+          swap_document(st);
+          collect_page_sizes(st);
+          collect_prefetched_pages(st);
+          update_search(st);
+        }
+        if (get_event_timeout(st) == 0)
+          finish_zoom(st);
+        continue;
+      }
       XNextEvent(st.display, &event);
 
       auto render_page_lambda = [&]() {
-        st.page = st.doc->create_page(st.page_num);
-        (!st.page) &&
-            error("Cannot create page: " + std::to_string(st.page_num) + ".");
+        st.page_frac = 0;
+        set_page(st, st.page_num);
         force_render_page(st);
         st.selection = {0, 0, 0, 0};
         st.pdf_selection = {0, 0, 0, 0};
@@ -505,34 +1863,21 @@ int main(int argc, char **argv) {
 
       switch(event.type) {
         case Expose: {
-          auto prev = st.pdf_pos;
-          if (st.pdf == None) {
-            auto prc = get_pdf_render_conf(
-                st.fit_page, st.scrolling_up, st.next_pos_y, st.main_pos, st.page,
-                st.magnifying, st.magnify, st.rotation);
-            st.scrolling_up = false;
-            st.next_pos_y = 0;
-
-            st.pdf = render_pdf_page_to_pixmap(st, prc);
-            st.pdf_pos = prc.pos; // Add anohter contructor
-          }
-          copy_pixmap_on_expose_event(st, prev, event.xexpose);
+          auto &e = event.xexpose;
+          expose(st, {e.x, e.y, e.width, e.height});
           break;
         }
 
         case ConfigureNotify:
           if (st.main_pos.width() != event.xconfigure.width ||
               st.main_pos.height() != event.xconfigure.height) {
+            finish_zoom(st);
             st.main_pos = {event.xconfigure.x, event.xconfigure.y,
                            event.xconfigure.width, event.xconfigure.height};
 
-            XClearWindow(st.display, st.main);
-            if (st.pdf != None) {
-              XFreePixmap(st.display, st.pdf);
-              st.pdf = None;
-            }
-
+            resize_back_buffer(st);
             st.status_pos = get_status_pos(st);
+            force_render_page(st);
           }
         break;
 
@@ -546,8 +1891,10 @@ int main(int argc, char **argv) {
               force_render_page(st);
               st.xembed_init = true;
             }
-          } else if (event.xclient.data.l[0] == (long)wmdel_atom)
+          } else if (event.xclient.data.l[0] == (long)wmdel_atom) {
+            cleanup_x(st);
             return 0;
+          }
           break;
         }
 
@@ -561,27 +1908,61 @@ int main(int argc, char **argv) {
             auto sc = &shortcuts[i];
             if (!status && sc->ksym == ksym &&
                 (sc->mask == AnyMask || sc->mask == event.xkey.state)) {
+              int x = event.xkey.x, y = event.xkey.y;
+              if (is_invalid(intersect(get_view(st), {x, y, 1, 1}))) {
+                x = st.main_pos.width() / 2;
+                y = st.main_pos.height() / 2;
+              }
+              if (sc->action != ZOOM_IN && sc->action != ZOOM_OUT &&
+                  sc->action != ZOOM_RESET)
+                finish_zoom(st);
+
               switch (sc->action) {
                 case QUIT:
+                  cleanup_x(st);
                   return 0;
                 break;
 
                 case FIT_PAGE:
-                  if (!st.fit_page) {
+                  if (!st.fit_page || st.continuous) {
                     st.fit_page = true;
+                    st.continuous = false;
                     force_render_page(st);
                   }
                 break;
 
                 case FIT_WIDTH:
-                  if (st.fit_page) {
+                  if (st.fit_page || st.continuous) {
                     st.fit_page = false;
+                    st.continuous = false;
+                    force_render_page(st);
+                  }
+                break;
+
+                case OVERVIEW:
+                  st.overview = !st.overview;
+                  clear_area(st, get_view(st));
+                  force_render_page(st);
+                break;
+
+                case CONTINUOUS:
+                  if (!st.continuous) {
+                    st.continuous = true;
+                    st.page_frac = 0;
                     force_render_page(st);
                   }
                 break;
 
                 case DOWN:
-                  if (st.fit_page) {
+                  if (st.overview) {
+                    scroll_overview(st, -get_overview_row_height(st) / 4);
+                    break;
+                  }
+                  if (is_continuous(st)) {
+                    scroll_continuous(st, -arrow_scroll);
+                    break;
+                  }
+                  if (st.fit_page && st.zoom == 1) {
                 case NEXT:
                   if (st.page_num < st.doc->pages()) {
                     ++st.page_num;
@@ -591,8 +1972,7 @@ int main(int argc, char **argv) {
                   } else {
                     int diff = get_pdf_scroll_diff(st, -arrow_scroll);
                     if (diff != 0) {
-                      st.pdf_pos.set_top(st.pdf_pos.y() + diff);
-                      force_render_page(st, false);
+                      scroll_pdf(st, 0, diff);
                     } else {
                       if (st.page_num < st.doc->pages()) {
                         ++st.page_num;
@@ -603,7 +1983,15 @@ int main(int argc, char **argv) {
                 break;
 
                 case UP:
-                  if (st.fit_page) {
+                  if (st.overview) {
+                    scroll_overview(st, get_overview_row_height(st) / 4);
+                    break;
+                  }
+                  if (is_continuous(st)) {
+                    scroll_continuous(st, arrow_scroll);
+                    break;
+                  }
+                  if (st.fit_page && st.zoom == 1) {
                 case PREV:
                   if (st.page_num > 1) {
                     --st.page_num;
@@ -614,8 +2002,7 @@ int main(int argc, char **argv) {
                   } else {
                     int diff = get_pdf_scroll_diff(st, arrow_scroll);
                     if (diff != 0) {
-                      st.pdf_pos.set_top(st.pdf_pos.y() + diff);
-                      force_render_page(st, false);
+                      scroll_pdf(st, 0, diff);
                     } else {
                       if (st.page_num > 1) {
                         st.scrolling_up = true;
@@ -626,6 +2013,14 @@ int main(int argc, char **argv) {
                   }
                 break;
 
+                case LEFT:
+                  scroll_sideways(st, arrow_scroll);
+                break;
+
+                case RIGHT:
+                  scroll_sideways(st, -arrow_scroll);
+                break;
+
                 case FIRST:
                   st.page_num = 1;
                   render_page_lambda();
@@ -648,13 +2043,8 @@ int main(int argc, char **argv) {
                 break;
 
                 case RELOAD:
-                  st.doc = std::unique_ptr<poppler::document>(
-                      poppler::document::load_from_file(file_name));
-
-                  if (st.page_num > st.doc->pages())
-                    st.page_num = 1;
-
-                  render_page_lambda();
+                  if (st.watcher)
+                    st.watcher->reload();
                 break;
 
                 case GOTO_PAGE:
@@ -663,7 +2053,7 @@ int main(int argc, char **argv) {
                   st.prompt =
                     "goto page [1, " + std::to_string(st.doc->pages()) + "]: ";
                   st.value = "";
-                  send_expose(st, st.status_pos);
+                  damage(st, st.status_pos);
                 break;
 
                 case SEARCH:
@@ -671,16 +2061,15 @@ int main(int argc, char **argv) {
                   st.input = true;
                   st.prompt = "search: ";
                   st.value = "";
-                  send_expose(st, st.status_pos);
+                  damage(st, st.status_pos);
                 break;
 
                 case PAGE:
                   st.status = true;
                   st.input = false;
-                  st.prompt = "page " + std::to_string(st.page_num) + "/" +
-                    std::to_string(st.doc->pages());
+                  st.prompt = get_page_status(st);
                   st.value = "";
-                  send_expose(st, st.status_pos);
+                  damage(st, st.status_pos);
                 break;
 
                 case MAGNIFY:
@@ -704,17 +2093,24 @@ int main(int argc, char **argv) {
                 break;
 
                 case ROTATE_CW:
-                  st.rotation += 90;
-                  if (st.rotation > 270)
-                    st.rotation = 0;
-                  force_render_page(st, true);
+                  rotate_view(st, 90);
                 break;
 
                 case ROTATE_CCW:
-                  st.rotation -= 90;
-                  if (st.rotation < 0)
-                    st.rotation = 270;
-                  force_render_page(st, true);
+                  rotate_view(st, 270);
+                break;
+
+                case ZOOM_IN:
+                  zoom_view(st, zoom_key_step, x, y);
+                break;
+
+                case ZOOM_OUT:
+                  zoom_view(st, 1 / zoom_key_step, x, y);
+                break;
+
+                case ZOOM_RESET:
+                  zoom_view(st, 1 / (st.zooming ? st.zoom_target : st.zoom),
+                            x, y);
                 break;
               }
             }
@@ -724,9 +2120,9 @@ int main(int argc, char **argv) {
             switch (ksym) {
               case XK_Escape:
                 st.status = st.searching = false;
-                XClearArea(st.display, st.main, st.status_pos.x(),
-                    st.status_pos.y(), st.status_pos.width(),
-                    st.status_pos.height(), True);
+                cancel_search(st);
+                clear_area(st, st.status_pos);
+                damage(st, st.status_pos);
 
                 if (st.magnifying) {
                   st.magnifying = false;
@@ -746,10 +2142,13 @@ int main(int argc, char **argv) {
 
                   while (num-- > 0)
                     st.value.pop_back();
+                  if (st.prompt.substr(0, 6) == "search")
+                    update_query(st);
+                  else
+                    cancel_search(st);
 
-                  XClearArea(st.display, st.main, st.status_pos.x(),
-                      st.status_pos.y(), st.status_pos.width(),
-                      st.status_pos.height(), True);
+                  clear_area(st, st.status_pos);
+                  damage(st, st.status_pos);
                 }
               break;
 
@@ -760,19 +2159,25 @@ int main(int argc, char **argv) {
                       st.value.data(), st.value.data() + st.value.size(), page);
                   if (ec == std::errc() && page >= 1 && page <= st.doc->pages()) {
                     st.status = false;
+                    push_location(st);
                     st.page_num = page;
 
-                    XClearArea(st.display, st.main, st.status_pos.x(),
-                        st.status_pos.y(), st.status_pos.width(),
-                        st.status_pos.height(), True);
+                    clear_area(st, st.status_pos);
+                    damage(st, st.status_pos);
                     render_page_lambda();
                   }
                 }
 
-                if (st.prompt.substr(0, 6) == "search") {
-                  send_expose(st, st.selection.normalized());
+                if (st.prompt.substr(0, 6) == "search")
                   search_text(st);
-                  send_expose(st, st.selection.normalized());
+              break;
+
+              case XK_Down:
+              case XK_Up:
+                if (st.search) {
+                  st.search_backwards = ksym == XK_Up;
+                  st.search_pending = true;
+                  jump_to_match(st);
                 }
               break;
             }
@@ -781,7 +2186,11 @@ int main(int argc, char **argv) {
               std::string s{buf};
               if (s != "" && !iscntrl((unsigned char)s[0])) {
                 st.value += s;
-                send_expose(st, st.status_pos);
+                if (st.prompt.substr(0, 6) == "search")
+                  update_query(st);
+                else
+                  cancel_search(st);
+                damage(st, st.status_pos);
               }
             }
           }
@@ -789,9 +2198,35 @@ int main(int argc, char **argv) {
         }
 
         case ButtonPress:
+          if ((event.xbutton.button == Button4 ||
+               event.xbutton.button == Button5) &&
+              (event.xbutton.state & ControlMask)) {
+            zoom_view(st,
+                      event.xbutton.button == Button4 ? zoom_wheel_step
+                                                      : 1 / zoom_wheel_step,
+                      event.xbutton.x, event.xbutton.y);
+            break;
+          }
+          finish_zoom(st);
+
+          // Buttons 6 and 7 are the wheel tilted left and right.
+          if (event.xbutton.button == 6 || event.xbutton.button == 7 ||
+              ((event.xbutton.button == Button4 ||
+                event.xbutton.button == Button5) &&
+               (event.xbutton.state & ShiftMask))) {
+            bool left = event.xbutton.button == 6 ||
+                        event.xbutton.button == Button4;
+            scroll_sideways(st, left ? mouse_scroll : -mouse_scroll);
+            break;
+          }
+
           switch (event.xbutton.button) {
             case Button4:
-              if (st.fit_page) {
+              if (st.overview) {
+                scroll_overview(st, get_overview_row_height(st) / 4);
+              } else if (is_continuous(st)) {
+                scroll_continuous(st, mouse_scroll);
+              } else if (st.fit_page && st.zoom == 1) {
                 if (!st.magnifying && st.page_num > 1) {
                   st.scrolling_up = true;
                   --st.page_num;
@@ -800,8 +2235,7 @@ int main(int argc, char **argv) {
               } else {
                 int diff = get_pdf_scroll_diff(st, mouse_scroll);
                 if (diff != 0) {
-                  st.pdf_pos.set_top(st.pdf_pos.y() + diff);
-                  force_render_page(st, false);
+                  scroll_pdf(st, 0, diff);
                 } else {
                   if (st.page_num > 1 && !st.magnifying) {
                     st.scrolling_up = true;
@@ -813,7 +2247,11 @@ int main(int argc, char **argv) {
             break;
 
             case Button5:
-              if (st.fit_page) {
+              if (st.overview) {
+                scroll_overview(st, -get_overview_row_height(st) / 4);
+              } else if (is_continuous(st)) {
+                scroll_continuous(st, -mouse_scroll);
+              } else if (st.fit_page && st.zoom == 1) {
                 if (!st.magnifying && st.page_num < st.doc->pages()) {
                   ++st.page_num;
                   render_page_lambda();
@@ -821,8 +2259,7 @@ int main(int argc, char **argv) {
               } else {
                 int diff = get_pdf_scroll_diff(st, -mouse_scroll);
                 if (diff != 0) {
-                  st.pdf_pos.set_top(st.pdf_pos.y() + diff);
-                  force_render_page(st, false);
+                  scroll_pdf(st, 0, diff);
                 } else {
                   if (st.page_num < st.doc->pages() && !st.magnifying) {
                     ++st.page_num;
@@ -833,7 +2270,24 @@ int main(int argc, char **argv) {
             break;
 
             case Button1:
-              if (!st.magnifying) {
+              if (st.overview) {
+                auto [first, last] = get_overview_pages(
+                    st, {event.xbutton.x, event.xbutton.y, 1, 1});
+                for (int n = first; n <= last; ++n) {
+                  auto cell = get_overview_cell(st, n);
+                  if (event.xbutton.x >= cell.x() &&
+                      event.xbutton.x < cell.right() &&
+                      event.xbutton.y >= cell.y() &&
+                      event.xbutton.y < cell.bottom()) {
+                    push_location(st);
+                    st.overview = false;
+                    st.page_num = n;
+                    clear_area(st, get_view(st));
+                    render_page_lambda();
+                    break;
+                  }
+                }
+              } else if (!st.magnifying) {
                 if (event.xbutton.x >= st.pdf_pos.x() &&
                     event.xbutton.y >= st.pdf_pos.y() &&
                     event.xbutton.x <= st.pdf_pos.x() + st.pdf_pos.width() &&
@@ -842,7 +2296,7 @@ int main(int argc, char **argv) {
                   st.selection = cc.to_screen(st.pdf_selection);
 
                   // Padding needed because of float rounding errors in cc.
-                  send_expose(st, st.selection.normalized().padded(5));
+                  damage(st, st.selection.normalized().padded(5));
 
                   st.selection = {event.xbutton.x, event.xbutton.y, 0, 0};
                   st.selecting = true;
@@ -854,22 +2308,42 @@ int main(int argc, char **argv) {
 
         case MotionNotify:
           if (st.selecting) {
-            auto pr = st.selection.normalized();
+            // Only the latest position matters, repaint inverts the
+            // difference once per batch.
+            while (XCheckTypedWindowEvent(st.display, st.main, MotionNotify,
+                                          &event))
+              ;
 
             st.selection.set_left(st.selection.x());
-            st.selection.set_right(event.xbutton.x);
+            st.selection.set_right(event.xmotion.x);
             st.selection.set_top(st.selection.y());
-            st.selection.set_bottom(event.xbutton.y);
-
-            auto nr = st.selection.normalized();
+            st.selection.set_bottom(event.xmotion.y);
+          }
+        break;
 
-            for (auto &r : subtract(pr, nr))
-              send_expose(st, r);
-            for (auto &r : subtract(nr, pr))
-              send_expose(st, r);
+        case ButtonRelease:
+          if (event.xbutton.button == Button1 && st.selecting) {
+            const CoordConv cc(st.page, st.pdf_pos, false, st.rotation);
+            auto r = get_band(st);
+            double x1 = r.x(), y1 = r.y();
+            double x2 = r.x() + r.width(), y2 = r.y() + r.height();
+            cc.to_pdf(x1, y1);
+            cc.to_pdf(x2, y2);
+
+            st.selecting = false;
+            st.pdf_selection = srectf{x1, y1, x2 - x1, y2 - y1}.normalized();
+            damage(st, r.padded(5));
           }
         break;
       }
+
+      if (st.status && st.prompt.substr(0, 5) == "page ") {
+        auto prompt = get_page_status(st);
+        if (prompt != st.prompt) {
+          st.prompt = prompt;
+          damage(st, st.status_pos);
+        }
+      }
     }
   } catch (std::exception &e) {
     std::cerr << e.what() << std::endl;
@@ -0,0 +1,45 @@
+#include <iterator>
+
+#include "pagecache.hpp"
+#include "trace.hpp"
+
+PageCache::PageCache(poppler::document *d, size_t c) : doc(d), capacity(c) {}
+
+// Returns NULL if page n cannot be created, the page is valid until it is
+// evicted by a later get().
+poppler::page *PageCache::get(int n) {
+  auto it = index.find(n);
+  if (it != index.end()) {
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->page.get();
+  }
+
+  std::unique_ptr<poppler::page> page;
+  {
+    TraceSpan span("create_page");
+    page.reset(doc->create_page(n - 1));
+  }
+  if (!page)
+    return NULL;
+
+  entries.push_front({n, std::move(page)});
+  index[n] = entries.begin();
+  evict();
+  return entries.front().page.get();
+}
+
+// The pinned page is the current one, borrowed for as long as it is shown.
+void PageCache::pin(int n) { pinned = n; }
+
+// The newest entry is about to be used and is never evicted.
+void PageCache::evict() {
+  auto it = std::prev(entries.end());
+  while (entries.size() > capacity && it != entries.begin()) {
+    auto victim = it--;
+    if (pinned && victim->n == *pinned)
+      continue;
+
+    index.erase(victim->n);
+    entries.erase(victim);
+  }
+}
@@ -0,0 +1,34 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+
+#include <poppler-document.h>
+#include <poppler-page.h>
+
+// Least recently used cache of the page objects of a document, owns its pages
+// and lends them out. Pages are numbered from 1, capacity is a page count.
+struct PageCache {
+  PageCache(poppler::document *doc, size_t capacity);
+  poppler::page *get(int n);
+  void pin(int n);
+
+private:
+  struct Entry {
+    int n;
+    std::unique_ptr<poppler::page> page;
+  };
+
+  void evict();
+
+  poppler::document *doc;
+  size_t capacity;
+  std::list<Entry> entries;
+  std::unordered_map<int, std::list<Entry>::iterator> index;
+  std::optional<int> pinned;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#include <chrono>
+#include <memory>
+
+#include <poppler-page.h>
+
+#include "pagesizes.hpp"
+#include "trace.hpp"
+
+// Shortest time between two notifications, each of which lays the document
+// out again.
+static const int notify_ms = 50;
+
+PageSizes::PageSizes(DocumentOpener o, int p, std::function<void()> n)
+    : open(o), notify(n), pages(p) {
+  thread = std::thread(&PageSizes::run, this);
+}
+
+PageSizes::~PageSizes() {
+  stop = true;
+  thread.join();
+}
+
+bool PageSizes::done() const {
+  std::lock_guard lk(mtx);
+  return finished;
+}
+
+// Copies the sizes read since the last call into rects. Returns whether any
+// of them differs from what rects had.
+bool PageSizes::take(std::vector<poppler::rectf> &rects) {
+  std::vector<std::pair<int, poppler::rectf>> sizes;
+  {
+    std::lock_guard lk(mtx);
+    sizes.swap(ready);
+  }
+
+  bool changed = false;
+  for (auto &[n, rect] : sizes) {
+    if (n > int(rects.size()))
+      continue;
+    auto &old = rects[n - 1];
+    changed = changed || rect.width() != old.width() ||
+              rect.height() != old.height();
+    old = rect;
+  }
+  return changed;
+}
+
+void PageSizes::run() {
+  TraceSpan span("measure_pages");
+  auto doc = open();
+  auto last = std::chrono::steady_clock::now();
+  for (int n = 1; doc && n <= pages && !stop; ++n) {
+    std::unique_ptr<poppler::page> page(doc->create_page(n - 1));
+    if (!page)
+      continue;
+    {
+      std::lock_guard lk(mtx);
+      ready.push_back({n, page->page_rect()});
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - last >= std::chrono::milliseconds(notify_ms)) {
+      last = now;
+      notify();
+    }
+  }
+
+  {
+    std::lock_guard lk(mtx);
+    finished = true;
+  }
+  notify();
+}
@@ -0,0 +1,39 @@
+#ifndef PAGESIZES_H
+#define PAGESIZES_H
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <poppler-rectangle.h>
+
+#include "docdata.hpp"
+
+// Sizes of every page of a document, read in a background thread with its own
+// document handle so that layouts showing every page do not wait for them.
+// The thread notifies at most every few tens of milliseconds, and once done.
+struct PageSizes {
+  PageSizes(DocumentOpener open, int pages, std::function<void()> notify);
+  ~PageSizes();
+  bool done() const;
+  bool take(std::vector<poppler::rectf> &rects);
+
+private:
+  void run();
+
+  DocumentOpener open;
+  std::function<void()> notify;
+  int pages;
+
+  mutable std::mutex mtx;
+  std::vector<std::pair<int, poppler::rectf>> ready;
+  bool finished = false;
+
+  std::atomic<bool> stop{false};
+  std::thread thread;
+};
+
+#endif
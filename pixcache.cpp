@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <iterator>
+
+#include "pixcache.hpp"
+
+PixmapCache::PixmapCache(Display *d, size_t c) : display(d), capacity(c) {}
+
+PixmapCache::~PixmapCache() { clear(); }
+
+Pixmap PixmapCache::get(const RenderKey &k) {
+  auto it = index.find(k);
+  if (it == index.end()) {
+    ++misses;
+    return None;
+  }
+  ++hits;
+
+  entries.splice(entries.begin(), entries, it->second);
+  return it->second->pixmap;
+}
+
+// Previews are drawn until the full render arrives but don't count as cached.
+bool PixmapCache::contains(const RenderKey &k) const {
+  auto it = index.find(k);
+  return it != index.end() && !it->second->preview;
+}
+
+bool PixmapCache::is_preview(const RenderKey &k) const {
+  auto it = index.find(k);
+  return it != index.end() && it->second->preview;
+}
+
+void PixmapCache::put(const RenderKey &k, Pixmap p, size_t bytes,
+                      bool preview) {
+  auto it = index.find(k);
+  if (it != index.end()) {
+    XFreePixmap(display, it->second->pixmap);
+    size -= it->second->bytes;
+    entries.erase(it->second);
+    index.erase(it);
+  }
+
+  size += bytes;
+  entries.push_front({k, p, bytes, preview});
+  index[k] = entries.begin();
+  evict();
+}
+
+// The pinned entry is the one on screen and must outlive any prefetching.
+void PixmapCache::pin(const RenderKey &k) { pinned = k; }
+
+size_t PixmapCache::bytes() const { return size; }
+
+// Drops the renders of the given pages, which must be sorted.
+void PixmapCache::erase_pages(const std::vector<int> &pages) {
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (!std::binary_search(pages.begin(), pages.end(), it->key.page)) {
+      ++it;
+      continue;
+    }
+
+    XFreePixmap(display, it->pixmap);
+    size -= it->bytes;
+    index.erase(it->key);
+    it = entries.erase(it);
+  }
+}
+
+void PixmapCache::clear() {
+  for (auto &e : entries)
+    XFreePixmap(display, e.pixmap);
+  entries.clear();
+  index.clear();
+  size = 0;
+  pinned.reset();
+}
+
+// The newest entry is about to be drawn and is never evicted.
+void PixmapCache::evict() {
+  auto it = std::prev(entries.end());
+  while (size > capacity && it != entries.begin()) {
+    auto victim = it--;
+    if (pinned && victim->key == *pinned)
+      continue;
+
+    XFreePixmap(display, victim->pixmap);
+    size -= victim->bytes;
+    index.erase(victim->key);
+    entries.erase(victim);
+  }
+}
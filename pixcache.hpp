@@ -0,0 +1,48 @@
+#ifndef PIXCACHE_H
+#define PIXCACHE_H
+
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "render.hpp"
+
+// Least recently used cache of rendered pages and tiles, owns its pixmaps.
+// The capacity is in bytes of pixmap memory.
+struct PixmapCache {
+  PixmapCache(Display *d, size_t capacity);
+  ~PixmapCache();
+  Pixmap get(const RenderKey &k);
+  bool contains(const RenderKey &k) const;
+  bool is_preview(const RenderKey &k) const;
+  void put(const RenderKey &k, Pixmap p, size_t bytes, bool preview = false);
+  void pin(const RenderKey &k);
+  void erase_pages(const std::vector<int> &pages);
+  void clear();
+  size_t bytes() const;
+  unsigned hits = 0;
+  unsigned misses = 0;
+
+private:
+  struct Entry {
+    RenderKey key;
+    Pixmap pixmap;
+    size_t bytes;
+    bool preview;
+  };
+
+  void evict();
+
+  Display *display;
+  size_t capacity;
+  size_t size = 0;
+  std::list<Entry> entries;
+  std::unordered_map<RenderKey, std::list<Entry>::iterator, RenderKeyHash>
+      index;
+  std::optional<RenderKey> pinned;
+};
+
+#endif
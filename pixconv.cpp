@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "pixconv.hpp"
+
+static const bool host_msb = std::endian::native == std::endian::big;
+
+PixelFormat get_pixel_format(Display *d, Visual *v, int depth) {
+  int bpp = depth > 16 ? 32 : depth > 8 ? 16 : 8;
+  int count;
+  if (auto formats = XListPixmapFormats(d, &count)) {
+    for (int i = 0; i < count; ++i)
+      if (formats[i].depth == depth)
+        bpp = formats[i].bits_per_pixel;
+    XFree(formats);
+  }
+  return {depth,        bpp,           ImageByteOrder(d) == MSBFirst,
+          v->red_mask, v->green_mask, v->blue_mask};
+}
+
+bool is_argb32(const PixelFormat &f) {
+  return f.bpp == 32 && f.msb_first == host_msb && f.red_mask == 0xff0000 &&
+         f.green_mask == 0xff00 && f.blue_mask == 0xff;
+}
+
+static bool is_rgb565(const PixelFormat &f) {
+  return f.bpp == 16 && f.msb_first == host_msb && f.red_mask == 0xf800 &&
+         f.green_mask == 0x07e0 && f.blue_mask == 0x1f;
+}
+
+static bool is_rgb30(const PixelFormat &f) {
+  return f.bpp == 32 && f.msb_first == host_msb &&
+         f.red_mask == 0x3ff00000 && f.green_mask == 0xffc00 &&
+         f.blue_mask == 0x3ff;
+}
+
+int get_bytes_per_line(const PixelFormat &f, int width) {
+  return (width * f.bpp + 31) / 32 * 4;
+}
+
+SimdLevel get_simd_level() {
+#ifdef HAVE_X86
+  static const SimdLevel level =
+      __builtin_cpu_supports("avx2")   ? SimdLevel::avx2
+      : __builtin_cpu_supports("sse2") ? SimdLevel::sse2
+                                       : SimdLevel::scalar;
+  return level;
+#else
+  return SimdLevel::scalar;
+#endif
+}
+
+static uint16_t to_rgb565(uint32_t p) {
+  return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x1f);
+}
+
+// Widens each channel to 10 bits by repeating its top bits.
+static uint32_t to_rgb30(uint32_t p) {
+  return ((p & 0xff0000) << 6) | ((p & 0xc00000) >> 2) | ((p & 0xff00) << 4) |
+         ((p & 0xc000) >> 4) | ((p & 0xff) << 2) | ((p & 0xc0) >> 6);
+}
+
+static void convert_rgb565(const uint32_t *src, char *dst, int n) {
+  for (int i = 0; i < n; ++i) {
+    uint16_t v = to_rgb565(src[i]);
+    std::memcpy(dst + i * 2, &v, 2);
+  }
+}
+
+static void convert_rgb30(const uint32_t *src, char *dst, int n) {
+  for (int i = 0; i < n; ++i) {
+    uint32_t v = to_rgb30(src[i]);
+    std::memcpy(dst + i * 4, &v, 4);
+  }
+}
+
+// Where an 8 bit channel goes in a mask with any number of bits.
+struct Channel {
+  int shift;
+  int bits;
+  uint32_t mask;
+
+  Channel(unsigned long m)
+      : shift(m ? std::countr_zero(m) : 0), bits(std::popcount(m)), mask(m) {}
+
+  uint32_t place(uint32_t c) const {
+    uint32_t v = bits <= 8 ? c >> (8 - bits)
+                           : (c << (bits - 8)) | (c >> std::max(0, 16 - bits));
+    return (v << shift) & mask;
+  }
+};
+
+static void convert_generic(const PixelFormat &f, const uint32_t *src,
+                            char *dst, int n) {
+  Channel r(f.red_mask), g(f.green_mask), b(f.blue_mask);
+  int bytes = f.bpp / 8;
+  for (int i = 0; i < n; ++i) {
+    uint32_t p = src[i];
+    uint32_t v = r.place((p >> 16) & 0xff) | g.place((p >> 8) & 0xff) |
+                 b.place(p & 0xff);
+    auto out = (unsigned char *)dst + i * bytes;
+    for (int k = 0; k < bytes; ++k)
+      out[f.msb_first ? bytes - 1 - k : k] = v >> (8 * k);
+  }
+}
+
+#ifdef HAVE_X86
+// Sign extended so the signed saturation of the pack keeps every bit.
+__attribute__((target("sse2"))) static __m128i pack_rgb565_sse2(__m128i p) {
+  auto v = _mm_or_si128(
+      _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xf800)),
+                   _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07e0))),
+      _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x1f)));
+  return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("sse2"))) static int
+convert_rgb565_sse2(const uint32_t *src, char *dst, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    auto a = pack_rgb565_sse2(_mm_loadu_si128((const __m128i *)(src + i)));
+    auto b = pack_rgb565_sse2(_mm_loadu_si128((const __m128i *)(src + i + 4)));
+    _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(a, b));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static __m256i pack_rgb565_avx2(__m256i p) {
+  auto v = _mm256_or_si256(
+      _mm256_or_si256(
+          _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xf800)),
+          _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07e0))),
+      _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x1f)));
+  return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("avx2"))) static int
+convert_rgb565_avx2(const uint32_t *src, char *dst, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto a = pack_rgb565_avx2(_mm256_loadu_si256((const __m256i *)(src + i)));
+    auto b =
+        pack_rgb565_avx2(_mm256_loadu_si256((const __m256i *)(src + i + 8)));
+    // The pack works per 128 bit lane, put the quarters back in order.
+    auto v = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+                                      _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *)(dst + i * 2), v);
+  }
+  return i;
+}
+
+__attribute__((target("sse2"))) static int
+convert_rgb30_sse2(const uint32_t *src, char *dst, int n) {
+  const auto m0 = _mm_set1_epi32(0xff0000), m1 = _mm_set1_epi32(0xc00000),
+             m2 = _mm_set1_epi32(0xff00), m3 = _mm_set1_epi32(0xc000),
+             m4 = _mm_set1_epi32(0xff), m5 = _mm_set1_epi32(0xc0);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    auto p = _mm_loadu_si128((const __m128i *)(src + i));
+    auto hi = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, m0), 6),
+                           _mm_srli_epi32(_mm_and_si128(p, m1), 2));
+    auto mid = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, m2), 4),
+                            _mm_srli_epi32(_mm_and_si128(p, m3), 4));
+    auto lo = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, m4), 2),
+                           _mm_srli_epi32(_mm_and_si128(p, m5), 6));
+    _mm_storeu_si128((__m128i *)(dst + i * 4),
+                     _mm_or_si128(_mm_or_si128(hi, mid), lo));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static int
+convert_rgb30_avx2(const uint32_t *src, char *dst, int n) {
+  const auto m0 = _mm256_set1_epi32(0xff0000),
+             m1 = _mm256_set1_epi32(0xc00000),
+             m2 = _mm256_set1_epi32(0xff00), m3 = _mm256_set1_epi32(0xc000),
+             m4 = _mm256_set1_epi32(0xff), m5 = _mm256_set1_epi32(0xc0);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    auto p = _mm256_loadu_si256((const __m256i *)(src + i));
+    auto hi = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, m0), 6),
+                              _mm256_srli_epi32(_mm256_and_si256(p, m1), 2));
+    auto mid = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, m2), 4),
+                               _mm256_srli_epi32(_mm256_and_si256(p, m3), 4));
+    auto lo = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, m4), 2),
+                              _mm256_srli_epi32(_mm256_and_si256(p, m5), 6));
+    _mm256_storeu_si256((__m256i *)(dst + i * 4),
+                        _mm256_or_si256(_mm256_or_si256(hi, mid), lo));
+  }
+  return i;
+}
+#endif
+
+// The vector kernels do whole blocks and leave the rest of the row to the
+// scalar ones. Each block is loaded before it is stored and the output is
+// never wider than the input, so converting in place is safe.
+void convert_pixels(const PixelFormat &f, const uint32_t *src, char *dst,
+                    int n, SimdLevel level) {
+  if (is_argb32(f)) {
+    if ((const char *)src != dst)
+      std::memmove(dst, src, size_t(n) * 4);
+    return;
+  }
+
+  int done = 0;
+  if (is_rgb565(f)) {
+#ifdef HAVE_X86
+    if (level == SimdLevel::avx2)
+      done = convert_rgb565_avx2(src, dst, n);
+    else if (level == SimdLevel::sse2)
+      done = convert_rgb565_sse2(src, dst, n);
+#endif
+    convert_rgb565(src + done, dst + done * 2, n - done);
+  } else if (is_rgb30(f)) {
+#ifdef HAVE_X86
+    if (level == SimdLevel::avx2)
+      done = convert_rgb30_avx2(src, dst, n);
+    else if (level == SimdLevel::sse2)
+      done = convert_rgb30_sse2(src, dst, n);
+#endif
+    convert_rgb30(src + done, dst + done * 4, n - done);
+  } else {
+    convert_generic(f, src, dst, n);
+  }
+}
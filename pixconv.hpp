@@ -0,0 +1,34 @@
+#ifndef PIXCONV_H
+#define PIXCONV_H
+
+#include <cstdint>
+
+#include <X11/Xlib.h>
+
+// How the server lays out the pixels of a visual in a ZPixmap image.
+struct PixelFormat {
+  int depth;
+  int bpp;
+  bool msb_first;
+  unsigned long red_mask;
+  unsigned long green_mask;
+  unsigned long blue_mask;
+};
+
+enum class SimdLevel { scalar, sse2, avx2 };
+
+PixelFormat get_pixel_format(Display *d, Visual *v, int depth);
+
+// True if poppler's argb32 rows can be handed to the server untouched.
+bool is_argb32(const PixelFormat &f);
+
+int get_bytes_per_line(const PixelFormat &f, int width);
+
+SimdLevel get_simd_level();
+
+// Converts n argb32 pixels to f. dst may alias src, formats never take more
+// than four bytes per pixel.
+void convert_pixels(const PixelFormat &f, const uint32_t *src, char *dst,
+                    int n, SimdLevel level = get_simd_level());
+
+#endif
@@ -83,20 +83,23 @@ std::vector<srectangle<T>> subtract(const srectangle<T> &a,
 
   std::vector<srectangle<T>> d;
 
+  T top = std::max(a.y(), b.y());
+  T bottom = std::min(a.y() + a.height(), b.y() + b.height());
+
   if (a.y() < b.y())
     d.push_back(srectangle<T>{a.x(), a.y(), a.width(), b.y() - a.y()});
 
   if (a.y() + a.height() > b.y() + b.height())
     d.push_back(srectangle<T>{a.x(), b.y() + b.height(), a.width(),
-                              a.y() + a.height() - b.y() + b.height()});
+                              a.y() + a.height() - b.y() - b.height()});
 
   if (a.x() < b.x())
-    d.push_back(srectangle<T>{a.x(), b.y(), b.x() - a.x(), b.height()});
+    d.push_back(srectangle<T>{a.x(), top, b.x() - a.x(), bottom - top});
 
   if (a.x() + a.width() > b.x() + b.width())
-    d.push_back(srectangle<T>{b.x() + b.width(), b.y(),
-                              a.x() + a.width() - b.x() + b.width(),
-                              b.height()});
+    d.push_back(srectangle<T>{b.x() + b.width(), top,
+                              a.x() + a.width() - b.x() - b.width(),
+                              bottom - top});
   return d;
 }
 
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "render.hpp"
+#include "trace.hpp"
+
+bool operator==(const RenderKey &a, const RenderKey &b) {
+  return a.page == b.page && a.dpi == b.dpi && a.crop == b.crop &&
+         a.rotation == b.rotation;
+}
+
+size_t RenderKeyHash::operator()(const RenderKey &k) const {
+  size_t h = std::hash<int>()(k.page);
+  for (size_t v : {std::hash<double>()(k.dpi), size_t(k.crop.x()),
+                   size_t(k.crop.y()), size_t(k.crop.width()),
+                   size_t(k.crop.height()), size_t(k.rotation)})
+    h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+  return h;
+}
+
+// Where r, given in page points, ends up once a page of size w x h is turned
+// clockwise by rotation degrees.
+static srectf rotate_rect(const srectf &r, double w, double h, int rotation) {
+  switch (rotation) {
+  case 90:
+    return {h - r.y() - r.height(), r.x(), r.height(), r.width()};
+  case 180:
+    return {w - r.x() - r.width(), h - r.y() - r.height(), r.width(),
+            r.height()};
+  case 270:
+    return {r.y(), w - r.x() - r.width(), r.height(), r.width()};
+  default:
+    return r;
+  }
+}
+
+PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int offset,
+                                  srect p, const poppler::rectf &rect,
+                                  bool magnifying, srectf m, int rotation,
+                                  double zoom) {
+  bool turned = rotation == 90 || rotation == 270;
+  auto x0 = turned ? rect.y() : rect.x();
+  auto y0 = turned ? rect.x() : rect.y();
+  auto width = turned ? rect.height() : rect.width();
+  auto height = turned ? rect.width() : rect.height();
+
+  if (magnifying) {
+    auto r = rotate_rect(m, rect.width(), rect.height(), rotation);
+    x0 = r.x();
+    y0 = r.y();
+    width = r.width();
+    height = r.height();
+  }
+
+  // Fitted to the window, then scaled by zoom.
+  int w, h;
+  double dpi;
+  if (fit_page && double(p.width()) / double(p.height()) > width / height) {
+    h = p.height() * zoom;
+    dpi = double(p.height()) * zoom * 72.0 / height;
+    w = width * dpi / 72.0;
+  } else {
+    w = p.width() * zoom;
+    dpi = double(p.width()) * zoom * 72.0 / width;
+    h = height * dpi / 72.0;
+  }
+
+  // Pages taller than the window start at offset, or at their bottom when
+  // reached scrolling up.
+  int x = (p.width() - w) / 2;
+  int y;
+  if (h <= p.height())
+    y = (p.height() - h) / 2;
+  else if (!scrolling_up)
+    y = offset;
+  else
+    y = p.height() - h;
+
+  auto scale = dpi / 72.0;
+  return {dpi,
+          {x, y, w, h},
+          {int(x0 * scale), int(y0 * scale), int(width * scale),
+           int(height * scale)},
+          rotation};
+}
+
+PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int offset,
+                                  srect p, const poppler::page *page,
+                                  bool magnifying, srectf m, int rotation,
+                                  double zoom) {
+  return get_pdf_render_conf(fit_page, scrolling_up, offset, p,
+                             page->page_rect(), magnifying, m, rotation, zoom);
+}
+
+// Splits the image described by prc into a grid of size x size tiles and
+// returns the ones intersecting r, with pos set to where each tile goes.
+std::vector<PdfRenderConf> get_tiles(const PdfRenderConf &prc, const srect &r,
+                                     int size) {
+  int x0 = std::max(0, r.x() - prc.pos.x());
+  int y0 = std::max(0, r.y() - prc.pos.y());
+  int x1 = std::min(prc.crop.width(), r.x() + r.width() - prc.pos.x());
+  int y1 = std::min(prc.crop.height(), r.y() + r.height() - prc.pos.y());
+
+  std::vector<PdfRenderConf> tiles;
+  for (int ty = y0 / size; ty * size < y1; ++ty) {
+    for (int tx = x0 / size; tx * size < x1; ++tx) {
+      int w = std::min(size, prc.crop.width() - tx * size);
+      int h = std::min(size, prc.crop.height() - ty * size);
+      tiles.push_back(
+          {prc.dpi,
+           {prc.pos.x() + tx * size, prc.pos.y() + ty * size, w, h},
+           {prc.crop.x() + tx * size, prc.crop.y() + ty * size, w, h},
+           prc.rotation});
+    }
+  }
+  return tiles;
+}
+
+void setup_renderer(poppler::page_renderer &r) {
+  r.set_render_hints(poppler::page_renderer::antialiasing |
+                     poppler::page_renderer::text_antialiasing);
+}
+
+static poppler::rotation_enum get_rotation(int degrees) {
+  switch (degrees) {
+  case 90:
+    return poppler::rotate_90;
+  case 180:
+    return poppler::rotate_180;
+  case 270:
+    return poppler::rotate_270;
+  default:
+    return poppler::rotate_0;
+  }
+}
+
+poppler::image render_pdf_page(const poppler::page_renderer &r,
+                               const poppler::page *page,
+                               const PdfRenderConf &prc) {
+  TraceSpan span("render_page");
+  return r.render_page(page, prc.dpi, prc.dpi, prc.crop.x(), prc.crop.y(),
+                       prc.crop.width(), prc.crop.height(),
+                       get_rotation(prc.rotation));
+}
+
+// Renders prc at a fraction of its resolution and scales the result back up
+// (nearest neighbour) to the size of the full render.
+poppler::image render_pdf_preview(const poppler::page_renderer &r,
+                                  const poppler::page *page,
+                                  const PdfRenderConf &prc, double scale) {
+  TraceSpan span("render_preview");
+  auto &c = prc.crop;
+  auto small = r.render_page(page, prc.dpi * scale, prc.dpi * scale,
+                             c.x() * scale, c.y() * scale,
+                             std::max(1, int(c.width() * scale)),
+                             std::max(1, int(c.height() * scale)),
+                             get_rotation(prc.rotation));
+  if (!small.is_valid() || small.width() == 0 || small.height() == 0)
+    return small;
+  return scale_image(small, c.width(), c.height());
+}
+
+// Nearest neighbour scaling of an argb32 image.
+poppler::image scale_image(const poppler::image &src, int w, int h) {
+  poppler::image img(w, h, poppler::image::format_argb32);
+  std::vector<int> xmap(w);
+  for (int x = 0; x < w; ++x)
+    xmap[x] = std::min(src.width() - 1, int(int64_t(x) * src.width() / w));
+
+  int prev = -1;
+  for (int y = 0; y < h; ++y) {
+    int sy = std::min(src.height() - 1, int(int64_t(y) * src.height() / h));
+    auto dst = (uint32_t *)(img.data() + size_t(y) * img.bytes_per_row());
+
+    // Consecutive rows often map to the same source row.
+    if (sy == prev) {
+      std::memcpy(dst, img.data() + size_t(y - 1) * img.bytes_per_row(),
+                  w * 4);
+      continue;
+    }
+    prev = sy;
+
+    auto s = (const uint32_t *)(src.const_data() +
+                                size_t(sy) * src.bytes_per_row());
+    for (int x = 0; x < w; ++x)
+      dst[x] = s[xmap[x]];
+  }
+  return img;
+}
+
+// Turns an argb32 image clockwise by 90, 180 or 270 degrees. Quarter turns
+// go through blocks small enough for both sides to stay in the L1 cache,
+// transposing 4x4 pixels at a time in SSE2 registers where available.
+poppler::image rotate_image(const poppler::image &src, int degrees) {
+  TraceSpan span("rotate_image");
+  degrees = (degrees % 360 + 360) % 360;
+  int w = src.width(), h = src.height();
+  bool turned = degrees == 90 || degrees == 270;
+  poppler::image dst(turned ? h : w, turned ? w : h,
+                     poppler::image::format_argb32);
+
+  auto in = [&](int x, int y) {
+    return (const uint32_t *)(src.const_data() +
+                              size_t(y) * src.bytes_per_row()) +
+           x;
+  };
+  auto out = [&](int x, int y) {
+    return (uint32_t *)(dst.data() + size_t(y) * dst.bytes_per_row()) + x;
+  };
+
+  if (!turned) {
+    for (int y = 0; y < h; ++y) {
+      auto s = in(0, y);
+      if (degrees == 0) {
+        std::memcpy(out(0, y), s, size_t(w) * 4);
+        continue;
+      }
+      auto d = out(0, h - 1 - y);
+      for (int x = 0; x < w; ++x)
+        d[w - 1 - x] = s[x];
+    }
+    return dst;
+  }
+
+  // Source pixel (x, y) goes to (h - 1 - y, x) for 90 degrees and to
+  // (y, w - 1 - x) for 270.
+  auto put = [&](int x, int y) {
+    if (degrees == 90)
+      *out(h - 1 - y, x) = *in(x, y);
+    else
+      *out(y, w - 1 - x) = *in(x, y);
+  };
+
+  const int block = 32;
+  for (int by = 0; by < h; by += block) {
+    int ey = std::min(h, by + block);
+    for (int bx = 0; bx < w; bx += block) {
+      int ex = std::min(w, bx + block);
+      int y = by;
+#ifdef __SSE2__
+      for (; y + 4 <= ey; y += 4) {
+        int x = bx;
+        for (; x + 4 <= ex; x += 4) {
+          auto r0 = _mm_loadu_si128((const __m128i *)in(x, y));
+          auto r1 = _mm_loadu_si128((const __m128i *)in(x, y + 1));
+          auto r2 = _mm_loadu_si128((const __m128i *)in(x, y + 2));
+          auto r3 = _mm_loadu_si128((const __m128i *)in(x, y + 3));
+          auto t0 = _mm_unpacklo_epi32(r0, r1);
+          auto t1 = _mm_unpacklo_epi32(r2, r3);
+          auto t2 = _mm_unpackhi_epi32(r0, r1);
+          auto t3 = _mm_unpackhi_epi32(r2, r3);
+          // Column x + i of the four rows.
+          __m128i c[4] = {
+              _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+              _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+          for (int i = 0; i < 4; ++i) {
+            if (degrees == 90)
+              _mm_storeu_si128((__m128i *)out(h - 4 - y, x + i),
+                               _mm_shuffle_epi32(c[i], _MM_SHUFFLE(0, 1, 2, 3)));
+            else
+              _mm_storeu_si128((__m128i *)out(y, w - 1 - x - i), c[i]);
+          }
+        }
+        for (; x < ex; ++x)
+          for (int i = 0; i < 4; ++i)
+            put(x, y + i);
+      }
+#endif
+      for (; y < ey; ++y)
+        for (int x = bx; x < ex; ++x)
+          put(x, y);
+    }
+  }
+  return dst;
+}
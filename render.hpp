@@ -0,0 +1,62 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <cstddef>
+#include <vector>
+
+#include <poppler-image.h>
+#include <poppler-page-renderer.h>
+#include <poppler-page.h>
+
+#include "rectangle.hpp"
+
+// crop is in the space of the page turned clockwise by rotation degrees.
+struct PdfRenderConf {
+  double dpi;
+  srect pos;
+  srect crop;
+  int rotation = 0;
+};
+
+// Identifies a rendered image independently of where it ends up on screen.
+struct RenderKey {
+  int page;
+  double dpi;
+  srect crop;
+  int rotation;
+};
+
+bool operator==(const RenderKey &a, const RenderKey &b);
+
+struct RenderKeyHash {
+  size_t operator()(const RenderKey &k) const;
+};
+
+PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int offset,
+                                  srect p, const poppler::rectf &rect,
+                                  bool magnifying, srectf m, int rotation,
+                                  double zoom);
+
+PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int offset,
+                                  srect p, const poppler::page *page,
+                                  bool magnifying, srectf m, int rotation,
+                                  double zoom);
+
+std::vector<PdfRenderConf> get_tiles(const PdfRenderConf &prc, const srect &r,
+                                     int size);
+
+void setup_renderer(poppler::page_renderer &r);
+
+poppler::image render_pdf_page(const poppler::page_renderer &r,
+                               const poppler::page *page,
+                               const PdfRenderConf &prc);
+
+poppler::image render_pdf_preview(const poppler::page_renderer &r,
+                                  const poppler::page *page,
+                                  const PdfRenderConf &prc, double scale);
+
+poppler::image scale_image(const poppler::image &src, int w, int h);
+
+poppler::image rotate_image(const poppler::image &src, int degrees);
+
+#endif
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+#include <poppler-page.h>
+
+#include "renderpool.hpp"
+
+RenderPool::RenderPool(DocumentOpener o, std::function<void()> n, int nthreads,
+                       DiskCache *d)
+    : open(o), notify(n), disk(d) {
+  for (int i = 0; i < nthreads; ++i)
+    threads.emplace_back(&RenderPool::worker, this);
+}
+
+RenderPool::~RenderPool() {
+  {
+    std::lock_guard lk(mtx);
+    stop = true;
+  }
+  cv.notify_all();
+  for (auto &t : threads)
+    t.join();
+}
+
+// Replaces any pending prefetch work. Jobs already running are finished, but
+// only the ones still in jobs are handed over.
+void RenderPool::prefetch(const std::vector<RenderJob> &jobs) {
+  {
+    std::lock_guard lk(mtx);
+    queue.clear();
+    wanted.clear();
+    for (auto &j : jobs) {
+      wanted.push_back(j.key);
+      auto same = [&](const RenderKey &k) { return k == j.key; };
+      auto queued = [&](const RenderJob &q) { return q.key == j.key; };
+      auto done = [&](const RenderResult &r) { return r.key == j.key; };
+      if (std::none_of(running.begin(), running.end(), same) &&
+          std::none_of(queue.begin(), queue.end(), queued) &&
+          std::none_of(results.begin(), results.end(), done))
+        queue.push_back(j);
+    }
+    std::stable_sort(queue.begin(), queue.end(),
+                     [](const RenderJob &a, const RenderJob &b) {
+                       return a.priority < b.priority;
+                     });
+  }
+  cv.notify_all();
+}
+
+std::vector<RenderResult> RenderPool::collect() {
+  std::lock_guard lk(mtx);
+  return std::move(results);
+}
+
+// Hands over the render of k if it is finished or, when wait is set, being
+// worked on. Otherwise the caller is better off rendering it itself.
+std::optional<RenderResult> RenderPool::take(const RenderKey &k, bool wait) {
+  std::unique_lock lk(mtx);
+  auto is_running = [&]() {
+    return std::find(running.begin(), running.end(), k) != running.end();
+  };
+
+  if (wait) {
+    std::erase_if(queue, [&](const RenderJob &j) { return j.key == k; });
+    wanted.push_back(k);
+    done_cv.wait(lk, [&]() { return !is_running(); });
+  }
+
+  auto it = std::find_if(results.begin(), results.end(),
+                         [&](const RenderResult &r) { return r.key == k; });
+  if (it == results.end())
+    return std::nullopt;
+
+  auto r = std::move(*it);
+  results.erase(it);
+  return r;
+}
+
+// Drops all work and makes workers reopen the document before their next job.
+void RenderPool::reload() {
+  std::unique_lock lk(mtx);
+  queue.clear();
+  wanted.clear();
+  ++generation;
+  ++doc_generation;
+  done_cv.wait(lk, [&]() { return running.empty(); });
+  results.clear();
+}
+
+void RenderPool::worker() {
+  std::shared_ptr<poppler::document> doc;
+  unsigned doc_gen = 0;
+  poppler::page_renderer renderer;
+  setup_renderer(renderer);
+
+  std::unique_lock lk(mtx);
+  while (true) {
+    cv.wait(lk, [&]() { return stop || !queue.empty(); });
+    if (stop)
+      return;
+
+    auto job = queue.front();
+    queue.pop_front();
+    running.push_back(job.key);
+    auto gen = generation;
+    bool reopen = !doc || doc_gen != doc_generation;
+    doc_gen = doc_generation;
+    lk.unlock();
+
+    if (reopen)
+      doc = open();
+
+    std::optional<RenderResult> res;
+    if (disk) {
+      if (auto img = disk->load(job.key))
+        res = RenderResult{job.key, job.prc, *img, 0};
+    }
+    if (!res && doc) {
+      std::unique_ptr<poppler::page> page(doc->create_page(job.key.page - 1));
+      if (page) {
+        auto start = std::chrono::steady_clock::now();
+        auto img = render_pdf_page(renderer, page.get(), job.prc);
+        std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - start;
+        res = RenderResult{job.key, job.prc, img, d.count()};
+        if (disk)
+          disk->store(job.key, img);
+      }
+    }
+
+    lk.lock();
+    std::erase(running, job.key);
+    bool keep = res && gen == generation &&
+                std::find(wanted.begin(), wanted.end(), job.key) != wanted.end();
+    if (keep)
+      results.push_back(std::move(*res));
+    done_cv.notify_all();
+
+    if (keep) {
+      lk.unlock();
+      notify();
+      lk.lock();
+    }
+  }
+}
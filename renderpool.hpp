@@ -0,0 +1,70 @@
+#ifndef RENDERPOOL_H
+#define RENDERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <poppler-document.h>
+
+#include "diskcache.hpp"
+#include "docdata.hpp"
+#include "render.hpp"
+
+// Queued jobs are picked in this order: what is on screen, what is just
+// around it or on the neighbouring pages, then the rest.
+enum class RenderPriority { visible, nearby, background };
+
+struct RenderJob {
+  RenderKey key;
+  PdfRenderConf prc;
+  RenderPriority priority = RenderPriority::visible;
+};
+
+struct RenderResult {
+  RenderKey key;
+  PdfRenderConf prc;
+  poppler::image img;
+  double ms;
+};
+
+// Renders pages on background threads, each with its own document handle as
+// poppler documents must not be shared between threads. Renders found in the
+// disk cache, if there is one, are read from it instead and new ones are
+// saved to it. poppler-cpp cannot abort a render, so stale work is dropped
+// between jobs: each prefetch() replaces the queue, and a running job that
+// is no longer wanted has its result thrown away.
+struct RenderPool {
+  RenderPool(DocumentOpener open, std::function<void()> notify, int threads,
+             DiskCache *disk);
+  ~RenderPool();
+  void prefetch(const std::vector<RenderJob> &jobs);
+  std::vector<RenderResult> collect();
+  std::optional<RenderResult> take(const RenderKey &k, bool wait);
+  void reload();
+
+private:
+  void worker();
+
+  DocumentOpener open;
+  std::function<void()> notify;
+  DiskCache *disk;
+  std::vector<std::thread> threads;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::condition_variable done_cv;
+  std::deque<RenderJob> queue;
+  std::vector<RenderKey> running;
+  std::vector<RenderKey> wanted;
+  std::vector<RenderResult> results;
+  unsigned generation = 0;
+  unsigned doc_generation = 0;
+  bool stop = false;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <memory>
+
+#include <poppler-page.h>
+
+#include "search.hpp"
+#include "trace.hpp"
+
+Search::Search(std::shared_ptr<TextIndex> i, DocumentOpener o, int p,
+               int s, bool b, const std::u32string &q, bool ic,
+               std::function<void()> n, std::shared_ptr<const Search> bs)
+    : query(q), icase(ic), index(i), open(o), notify(n), pages(p), start(s),
+      backwards(b), results(p + 1) {
+  if (bs && bs->icase == icase && query.starts_with(bs->query))
+    base = bs;
+  thread = std::thread(&Search::run, this);
+}
+
+Search::~Search() {
+  stop = true;
+  thread.join();
+}
+
+// Stops scanning after the page being scanned. What was found so far is kept.
+void Search::cancel() { stop = true; }
+
+std::optional<std::vector<size_t>> Search::get(int page) const {
+  std::lock_guard lk(mtx);
+  return results[page];
+}
+
+bool Search::done() const {
+  std::lock_guard lk(mtx);
+  return nscanned == pages;
+}
+
+int Search::scanned() const {
+  std::lock_guard lk(mtx);
+  return nscanned;
+}
+
+size_t Search::count() const {
+  std::lock_guard lk(mtx);
+  return nhits;
+}
+
+std::vector<size_t> Search::hits(int page) const {
+  std::lock_guard lk(mtx);
+  if (page < 1 || page > pages || !results[page])
+    return {};
+  return *results[page];
+}
+
+// The match following (or preceding) offset after on page, or the first one
+// from page on when after is empty. Sets pending when the answer depends on
+// pages that have not been scanned yet.
+std::optional<SearchHit> Search::next(int page, std::optional<size_t> after,
+                                      bool back, bool &pending) const {
+  std::lock_guard lk(mtx);
+  pending = false;
+  bool skip = after.has_value();
+  size_t offset = after.value_or(0);
+  for (int i = 0; i <= pages; ++i) {
+    if (!results[page]) {
+      pending = true;
+      return std::nullopt;
+    }
+
+    auto &r = *results[page];
+    if (!back) {
+      auto it = skip ? std::upper_bound(r.begin(), r.end(), offset) : r.begin();
+      if (it != r.end())
+        return SearchHit{page, *it};
+    } else {
+      auto it = skip ? std::lower_bound(r.begin(), r.end(), offset) : r.end();
+      if (it != r.begin())
+        return SearchHit{page, *--it};
+    }
+
+    page = back ? (page > 1 ? page - 1 : pages) : (page < pages ? page + 1 : 1);
+    skip = false;
+  }
+  return std::nullopt;
+}
+
+void Search::run() {
+  TraceSpan span("search");
+  std::shared_ptr<poppler::document> doc;
+  int page = start;
+  for (int i = 0; i < pages && !stop; ++i) {
+    std::optional<std::vector<size_t>> found;
+    if (auto prev = base ? base->get(page) : std::nullopt)
+      found = base->query == query
+                  ? prev
+                  : index->narrow(page, *prev, query, icase);
+    if (!found)
+      found = index->find(page, query, icase);
+    if (!found) {
+      if (!doc)
+        doc = open();
+      std::unique_ptr<poppler::page> p(doc ? doc->create_page(page - 1) : NULL);
+      index->add_page(page, p ? extract_page_text(p.get()) : PageText{});
+      found = index->find(page, query, icase);
+    }
+
+    bool any;
+    {
+      std::lock_guard lk(mtx);
+      any = !found->empty();
+      nhits += found->size();
+      results[page] = std::move(*found);
+      ++nscanned;
+    }
+
+    // Progress is reported every few pages, hits right away.
+    if (any || i % 64 == 63 || i == pages - 1)
+      notify();
+
+    page = backwards ? (page > 1 ? page - 1 : pages)
+                     : (page < pages ? page + 1 : 1);
+  }
+}
+
+SearchReaper::SearchReaper() { thread = std::thread(&SearchReaper::run, this); }
+
+SearchReaper::~SearchReaper() {
+  {
+    std::lock_guard lk(mtx);
+    stop = true;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+void SearchReaper::release(std::shared_ptr<Search> s) {
+  if (!s)
+    return;
+  s->cancel();
+  {
+    std::lock_guard lk(mtx);
+    queue.push_back(std::move(s));
+  }
+  cv.notify_all();
+}
+
+void SearchReaper::run() {
+  std::unique_lock lk(mtx);
+  while (true) {
+    cv.wait(lk, [&]() { return stop || !queue.empty(); });
+    if (queue.empty())
+      return;
+
+    auto dropped = std::move(queue);
+    queue.clear();
+    lk.unlock();
+    dropped.clear();
+    lk.lock();
+  }
+}
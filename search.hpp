@@ -0,0 +1,84 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poppler-document.h>
+
+#include "docdata.hpp"
+#include "textindex.hpp"
+
+struct SearchHit {
+  int page;
+  size_t offset;
+};
+
+// Looks for a query on every page of the document in a background thread,
+// starting at a given page and going forward (or backwards) with wrap around.
+// Pages missing from the index are indexed along the way. Pages a base search
+// for a prefix of the query has scanned are narrowed down from its matches.
+struct Search {
+  Search(std::shared_ptr<TextIndex> index, DocumentOpener open,
+         int pages, int start, bool backwards, const std::u32string &query,
+         bool icase, std::function<void()> notify,
+         std::shared_ptr<const Search> base = nullptr);
+  ~Search();
+  void cancel();
+  bool done() const;
+  int scanned() const;
+  size_t count() const;
+  std::vector<size_t> hits(int page) const;
+  std::optional<SearchHit> next(int page, std::optional<size_t> after,
+                                bool backwards, bool &pending) const;
+
+  const std::u32string query;
+  const bool icase;
+
+private:
+  void run();
+  std::optional<std::vector<size_t>> get(int page) const;
+
+  std::shared_ptr<TextIndex> index;
+  DocumentOpener open;
+  std::function<void()> notify;
+  int pages;
+  int start;
+  bool backwards;
+  std::shared_ptr<const Search> base;
+
+  mutable std::mutex mtx;
+  std::vector<std::optional<std::vector<size_t>>> results;
+  int nscanned = 0;
+  size_t nhits = 0;
+
+  std::atomic<bool> stop{false};
+  std::thread thread;
+};
+
+// Releases searches on a thread of its own. A search stops between pages
+// only, and may be opening the document or extracting a page, so the caller
+// does not wait for its thread. The destructor waits for all of them.
+struct SearchReaper {
+  SearchReaper();
+  ~SearchReaper();
+  void release(std::shared_ptr<Search> s);
+
+private:
+  void run();
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<std::shared_ptr<Search>> queue;
+  bool stop = false;
+  std::thread thread;
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cwctype>
+#include <filesystem>
+#include <fstream>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "diskcache.hpp"
+#include "textindex.hpp"
+#include "trace.hpp"
+
+static std::u32string to_u32(const poppler::ustring &s) {
+  std::u32string r;
+  r.reserve(s.size());
+  for (size_t i = 0; i < s.size(); ++i) {
+    char32_t c = s[i];
+    if (c >= 0xd800 && c < 0xdc00 && i + 1 < s.size() && s[i + 1] >= 0xdc00 &&
+        s[i + 1] < 0xe000)
+      c = 0x10000 + ((c - 0xd800) << 10) + (s[++i] - 0xdc00);
+    r += c;
+  }
+  return r;
+}
+
+PageText extract_page_text(const poppler::page *page) {
+  TraceSpan span("extract_text");
+  PageText pt;
+  auto boxes = page->text_list();
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    auto &b = boxes[i];
+    auto bbox = b.bbox();
+    auto word = to_u32(b.text());
+    pt.words.push_back({uint32_t(pt.text.size()), uint32_t(word.size()),
+                        float(bbox.x()), float(bbox.y()), float(bbox.width()),
+                        float(bbox.height())});
+    pt.text += word;
+
+    // Words on different lines are separated even without a trailing space,
+    // so phrases can be found across line breaks.
+    bool same_line = i + 1 < boxes.size() &&
+                     std::abs(boxes[i + 1].bbox().y() - bbox.y()) <
+                         bbox.height() / 2;
+    if (b.has_space_after() || !same_line)
+      pt.text += U' ';
+  }
+  return pt;
+}
+
+TextIndex::TextIndex(DocumentOpener o, std::shared_ptr<const DocumentData> d,
+                     int p, int threads, const std::string &c, size_t cs)
+    : open(o), data(d), cache_dir(c), cache_size(cs), pages(p),
+      texts(p + 1) {
+  thread = std::thread(&TextIndex::run, this, threads);
+}
+
+TextIndex::~TextIndex() {
+  stop = true;
+  thread.join();
+}
+
+bool TextIndex::has_page(int page) const { return get(page) != nullptr; }
+
+void TextIndex::add_page(int page, PageText &&text) {
+  std::lock_guard lk(mtx);
+  if (page < 1 || page > pages || texts[page])
+    return;
+  texts[page] = std::make_shared<const PageText>(std::move(text));
+  ++count;
+}
+
+int TextIndex::indexed() const {
+  std::lock_guard lk(mtx);
+  return count;
+}
+
+std::shared_ptr<const PageText> TextIndex::get(int page) const {
+  std::lock_guard lk(mtx);
+  if (page < 1 || page > pages)
+    return nullptr;
+  return texts[page];
+}
+
+static std::u32string fold(std::u32string s) {
+  for (auto &c : s)
+    c = std::towlower(wint_t(c));
+  return s;
+}
+
+// Offsets of all occurrences of q on page, nothing if the page has not been
+// indexed yet.
+std::optional<std::vector<size_t>>
+TextIndex::find(int page, const std::u32string &q, bool icase) const {
+  auto pt = get(page);
+  if (!pt)
+    return std::nullopt;
+
+  std::vector<size_t> r;
+  if (q.empty())
+    return r;
+
+  auto text = icase ? fold(pt->text) : pt->text;
+  auto needle = icase ? fold(q) : q;
+  for (auto p = text.find(needle); p != text.npos; p = text.find(needle, p + 1))
+    r.push_back(p);
+  return r;
+}
+
+// The offsets among the given ones where q occurs on page, nothing if the page
+// has not been indexed yet. Narrows the matches of a prefix of q without
+// looking at the rest of the text.
+std::optional<std::vector<size_t>>
+TextIndex::narrow(int page, const std::vector<size_t> &offsets,
+                  const std::u32string &q, bool icase) const {
+  auto pt = get(page);
+  if (!pt)
+    return std::nullopt;
+
+  auto same = [icase](char32_t a, char32_t b) {
+    return a == b ||
+           (icase && std::towlower(wint_t(a)) == std::towlower(wint_t(b)));
+  };
+  std::vector<size_t> r;
+  for (size_t off : offsets) {
+    if (off + q.size() <= pt->text.size() &&
+        std::equal(q.begin(), q.end(), pt->text.begin() + off, same))
+      r.push_back(off);
+  }
+  return r;
+}
+
+// Bounding box of the words covering [offset, offset + length).
+srectf TextIndex::match_rect(int page, size_t offset, size_t length) const {
+  auto pt = get(page);
+  if (!pt)
+    return {0, 0, 0, 0};
+
+  double x1 = 1e9, y1 = 1e9, x2 = -1e9, y2 = -1e9;
+  for (auto &w : pt->words) {
+    if (w.offset + w.length <= offset || w.offset >= offset + length)
+      continue;
+    x1 = std::min<double>(x1, w.x);
+    y1 = std::min<double>(y1, w.y);
+    x2 = std::max<double>(x2, w.x + w.w);
+    y2 = std::max<double>(y2, w.y + w.h);
+  }
+  if (x1 > x2)
+    return {0, 0, 0, 0};
+  return {x1, y1, x2 - x1, y2 - y1};
+}
+
+void TextIndex::run(int threads) {
+  std::string path;
+  if (!cache_dir.empty()) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx",
+             (unsigned long long)get_document_id(*data));
+    path = cache_dir + "/index/" + name;
+    if (stop || load(path))
+      return;
+  }
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; ++i)
+    workers.emplace_back(&TextIndex::worker, this);
+  for (auto &t : workers)
+    t.join();
+
+  if (!path.empty() && !stop && indexed() == pages)
+    save(path);
+}
+
+void TextIndex::worker() {
+  // Indexing gives way to the renders of what is on screen.
+  setpriority(PRIO_PROCESS, gettid(), 10);
+  auto doc = open();
+  if (!doc)
+    return;
+
+  for (int n = next++; n <= pages && !stop; n = next++) {
+    if (has_page(n))
+      continue;
+    std::unique_ptr<poppler::page> page(doc->create_page(n - 1));
+    add_page(n, page ? extract_page_text(page.get()) : PageText{});
+  }
+}
+
+// The file layout is: magic, page count, then for each page the number of
+// characters, the characters, the number of words and the words.
+static const char index_magic[8] = {'S', 'P', 'D', 'F', 'I', 'D', 'X', '2'};
+
+template <class T> static void write_pod(std::ostream &out, const T &v) {
+  out.write((const char *)&v, sizeof(v));
+}
+
+template <class T> static bool read_pod(std::istream &in, T &v) {
+  return bool(in.read((char *)&v, sizeof(v)));
+}
+
+bool TextIndex::load(const std::string &path) {
+  TraceSpan span("load_index");
+  std::ifstream in(path, std::ios::binary);
+  char magic[8];
+  int32_t n;
+  if (!in.read(magic, 8) || !std::equal(magic, magic + 8, index_magic) ||
+      !read_pod(in, n) || n != pages)
+    return false;
+
+  std::vector<PageText> loaded(pages + 1);
+  for (int i = 1; i <= pages; ++i) {
+    auto &pt = loaded[i];
+    uint32_t nchars, nwords;
+    if (!read_pod(in, nchars) || nchars > (1u << 28))
+      return false;
+    pt.text.resize(nchars);
+    if (!in.read((char *)pt.text.data(), nchars * sizeof(char32_t)))
+      return false;
+    if (!read_pod(in, nwords) || nwords > (1u << 26))
+      return false;
+    pt.words.resize(nwords);
+    if (!in.read((char *)pt.words.data(), nwords * sizeof(PageText::Word)))
+      return false;
+  }
+
+  for (int i = 1; i <= pages; ++i)
+    add_page(i, std::move(loaded[i]));
+
+  // The modification time orders indexes for trimming.
+  std::error_code ec;
+  std::filesystem::last_write_time(
+      path, std::filesystem::file_time_type::clock::now(), ec);
+  return true;
+}
+
+void TextIndex::save(const std::string &path) const {
+  TraceSpan span("save_index");
+  std::error_code ec;
+  std::filesystem::create_directories(
+      std::filesystem::path(path).parent_path(), ec);
+
+  // Written aside and renamed so a concurrent reader never sees half of it.
+  std::string tmp = path + ".tmp";
+  std::ofstream out(tmp, std::ios::binary);
+  out.write(index_magic, 8);
+  write_pod(out, int32_t(pages));
+  for (int i = 1; i <= pages; ++i) {
+    auto pt = get(i);
+    PageText empty;
+    auto &p = pt ? *pt : empty;
+    write_pod(out, uint32_t(p.text.size()));
+    out.write((const char *)p.text.data(), p.text.size() * sizeof(char32_t));
+    write_pod(out, uint32_t(p.words.size()));
+    out.write((const char *)p.words.data(),
+              p.words.size() * sizeof(PageText::Word));
+  }
+  out.close();
+
+  if (out)
+    std::filesystem::rename(tmp, path, ec);
+  else
+    std::filesystem::remove(tmp, ec);
+  trim_dir(std::filesystem::path(path).parent_path().string(), cache_size);
+}
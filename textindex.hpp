@@ -0,0 +1,76 @@
+#ifndef TEXTINDEX_H
+#define TEXTINDEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poppler-document.h>
+#include <poppler-page.h>
+
+#include "docdata.hpp"
+#include "rectangle.hpp"
+
+// Text of a page as one string, with the position of each word in it.
+struct PageText {
+  struct Word {
+    uint32_t offset;
+    uint32_t length;
+    float x, y, w, h;
+  };
+
+  std::u32string text;
+  std::vector<Word> words;
+};
+
+PageText extract_page_text(const poppler::page *page);
+
+// Full text of a document, filled by background threads (each with its own
+// document handle) and optionally saved under cache_dir, keyed by the
+// document id, with the least recently used indexes removed past cache_size
+// bytes.
+struct TextIndex {
+  TextIndex(DocumentOpener open, std::shared_ptr<const DocumentData> data,
+            int pages, int threads,
+            const std::string &cache_dir, size_t cache_size);
+  ~TextIndex();
+  bool has_page(int page) const;
+  void add_page(int page, PageText &&text);
+  int indexed() const;
+  std::optional<std::vector<size_t>> find(int page, const std::u32string &q,
+                                          bool icase) const;
+  std::optional<std::vector<size_t>> narrow(int page,
+                                            const std::vector<size_t> &offsets,
+                                            const std::u32string &q,
+                                            bool icase) const;
+  srectf match_rect(int page, size_t offset, size_t length) const;
+
+private:
+  std::shared_ptr<const PageText> get(int page) const;
+  void run(int threads);
+  void worker();
+  bool load(const std::string &path);
+  void save(const std::string &path) const;
+
+  DocumentOpener open;
+  std::shared_ptr<const DocumentData> data;
+  std::string cache_dir;
+  size_t cache_size;
+  int pages;
+
+  mutable std::mutex mtx;
+  std::vector<std::shared_ptr<const PageText>> texts;
+  int count = 0;
+
+  std::atomic<int> next{1};
+  std::atomic<bool> stop{false};
+  std::thread thread;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include <algorithm>
+
+#include "thumbatlas.hpp"
+
+ThumbAtlas::ThumbAtlas(Display *d, int s, int slots)
+    : display(d), slot_size(s), columns(16) {
+  int rows = (slots + columns - 1) / columns;
+  int screen = DefaultScreen(display);
+  atlas = XCreatePixmap(display, DefaultRootWindow(display), columns * s,
+                        rows * s, DefaultDepth(display, screen));
+  for (int i = slots - 1; i >= 0; --i)
+    free_slots.push_back(i);
+}
+
+ThumbAtlas::~ThumbAtlas() { XFreePixmap(display, atlas); }
+
+// Where the thumbnail is in the atlas pixmap, if it is there.
+std::optional<srect> ThumbAtlas::get(const RenderKey &k) {
+  auto it = index.find(k);
+  if (it == index.end())
+    return std::nullopt;
+
+  entries.splice(entries.begin(), entries, it->second);
+  return get_slot_rect(it->second->slot);
+}
+
+// Copies the width x height thumbnail from p, which stays owned by the caller.
+void ThumbAtlas::put(const RenderKey &k, Pixmap p, int width, int height) {
+  int slot;
+  if (auto it = index.find(k); it != index.end()) {
+    slot = it->second->slot;
+    entries.erase(it->second);
+    index.erase(it);
+  } else if (!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  } else {
+    slot = entries.back().slot;
+    index.erase(entries.back().key);
+    entries.pop_back();
+  }
+
+  auto r = get_slot_rect(slot);
+  XCopyArea(display, p, atlas, DefaultGC(display, DefaultScreen(display)), 0,
+            0, std::min(width, slot_size), std::min(height, slot_size), r.x(),
+            r.y());
+  entries.push_front({k, slot});
+  index[k] = entries.begin();
+}
+
+// Frees the slots of the given pages, which must be sorted.
+void ThumbAtlas::erase_pages(const std::vector<int> &pages) {
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (!std::binary_search(pages.begin(), pages.end(), it->key.page)) {
+      ++it;
+      continue;
+    }
+
+    free_slots.push_back(it->slot);
+    index.erase(it->key);
+    it = entries.erase(it);
+  }
+}
+
+Pixmap ThumbAtlas::pixmap() const { return atlas; }
+
+srect ThumbAtlas::get_slot_rect(int slot) const {
+  return {(slot % columns) * slot_size, (slot / columns) * slot_size,
+          slot_size, slot_size};
+}
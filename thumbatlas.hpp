@@ -0,0 +1,42 @@
+#ifndef THUMBATLAS_H
+#define THUMBATLAS_H
+
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "rectangle.hpp"
+#include "render.hpp"
+
+// Page thumbnails kept in the square slots of a single pixmap, the least
+// recently used slot is reused once every slot is taken.
+struct ThumbAtlas {
+  ThumbAtlas(Display *d, int slot_size, int slots);
+  ~ThumbAtlas();
+  std::optional<srect> get(const RenderKey &k);
+  void put(const RenderKey &k, Pixmap p, int width, int height);
+  void erase_pages(const std::vector<int> &pages);
+  Pixmap pixmap() const;
+
+private:
+  struct Entry {
+    RenderKey key;
+    int slot;
+  };
+
+  srect get_slot_rect(int slot) const;
+
+  Display *display;
+  Pixmap atlas;
+  int slot_size;
+  int columns;
+  std::vector<int> free_slots;
+  std::list<Entry> entries;
+  std::unordered_map<RenderKey, std::list<Entry>::iterator, RenderKeyHash>
+      index;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "trace.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static std::mutex mtx;
+static std::unordered_map<std::string, TraceStat> stats;
+static FILE *out = NULL;
+static bool first_event = true;
+static const Clock::time_point epoch = Clock::now();
+
+static int thread_id() {
+  static std::atomic<int> next{1};
+  thread_local int id = next++;
+  return id;
+}
+
+TraceSpan::TraceSpan(const char *n) : name(n), start(Clock::now()) {}
+
+TraceSpan::~TraceSpan() {
+  auto end = Clock::now();
+  std::chrono::duration<double, std::milli> d = end - start;
+  std::chrono::duration<double, std::micro> ts = start - epoch;
+
+  std::lock_guard lk(mtx);
+  auto &s = stats[name];
+  ++s.count;
+  s.last_ms = d.count();
+  s.total_ms += d.count();
+
+  if (out) {
+    fprintf(out,
+            "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,"
+            "\"pid\":1,\"tid\":%d}",
+            first_event ? "\n" : ",\n", name, ts.count(), d.count() * 1000,
+            thread_id());
+    first_event = false;
+  }
+}
+
+// Events are streamed as they happen, so a trace cut short by a crash can
+// still be loaded (the closing bracket is optional in this format).
+void trace_open(const char *path) {
+  std::lock_guard lk(mtx);
+  out = fopen(path, "w");
+  if (out)
+    fputs("[", out);
+}
+
+void trace_close() {
+  std::lock_guard lk(mtx);
+  if (!out)
+    return;
+  fputs("\n]\n", out);
+  fclose(out);
+  out = NULL;
+}
+
+TraceStat trace_stat(const char *name) {
+  std::lock_guard lk(mtx);
+  auto it = stats.find(name);
+  return it == stats.end() ? TraceStat{0, 0, 0} : it->second;
+}
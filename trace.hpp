@@ -0,0 +1,27 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+
+// Times the enclosing scope. Spans are summed up per name and, once
+// trace_open() was called, written out in Chrome trace event format.
+struct TraceSpan {
+  TraceSpan(const char *name);
+  ~TraceSpan();
+
+private:
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+};
+
+struct TraceStat {
+  unsigned count;
+  double last_ms;
+  double total_ms;
+};
+
+void trace_open(const char *path);
+void trace_close();
+TraceStat trace_stat(const char *name);
+
+#endif
@@ -0,0 +1,197 @@
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xutil.h>
+
+#include "trace.hpp"
+#include "upload.hpp"
+
+static bool shm_failed;
+
+static int shm_error_handler(Display *, XErrorEvent *) {
+  shm_failed = true;
+  return 0;
+}
+
+// A remote server would accept the extension but never see our memory.
+static bool is_local(Display *d) {
+  std::string name = DisplayString(d);
+  return name.starts_with(":") || name.starts_with("unix:");
+}
+
+Uploader::Uploader(Display *d) : display(d) {
+  int screen = DefaultScreen(display);
+  visual = DefaultVisual(display, screen);
+  depth = DefaultDepth(display, screen);
+  format = get_pixel_format(display, visual, depth);
+  shm = is_local(display) && XShmQueryExtension(display) &&
+        !std::getenv("SPDF_NO_SHM");
+}
+
+Uploader::~Uploader() { detach(); }
+
+Pixmap Uploader::upload(poppler::image &img) {
+  TraceSpan span("upload");
+  auto start = std::chrono::steady_clock::now();
+
+  Pixmap pxm = None;
+  if (shm)
+    pxm = upload_shm(img);
+  if (pxm == None)
+    pxm = upload_put(img);
+
+  std::chrono::duration<double, std::milli> d =
+      std::chrono::steady_clock::now() - start;
+  last = d.count();
+  total += last;
+  ++count;
+  return pxm;
+}
+
+// Reads back a pixmap uploaded earlier. The segment is attached read only,
+// so this always goes through XGetImage(). Only argb32 visuals read back
+// without loss, others get an invalid image.
+poppler::image Uploader::download(Pixmap pxm, int w, int h) {
+  TraceSpan span("download");
+  if (!is_argb32(format))
+    return {};
+  poppler::image img(w, h, poppler::image::format_argb32);
+  auto xim = XGetImage(display, pxm, 0, 0, w, h, AllPlanes, ZPixmap);
+  if (!xim)
+    return {};
+
+  for (int y = 0; y < h; ++y)
+    std::memcpy(img.data() + y * img.bytes_per_row(),
+                xim->data + y * xim->bytes_per_line,
+                std::min(xim->bytes_per_line, img.bytes_per_row()));
+  XDestroyImage(xim);
+  return img;
+}
+
+bool Uploader::using_shm() const { return shm; }
+
+double Uploader::last_ms() const { return last; }
+
+double Uploader::average_ms() const { return count ? total / count : 0; }
+
+// Grows the shared segment to at least bytes, falls back to XPutImage() for
+// good if the server refuses to attach it.
+bool Uploader::reserve(size_t bytes) {
+  if (bytes <= capacity)
+    return true;
+
+  detach();
+
+  info.shmid = shmget(IPC_PRIVATE, bytes, IPC_CREAT | 0600);
+  if (info.shmid < 0)
+    return shm = false;
+
+  info.shmaddr = (char *)shmat(info.shmid, NULL, 0);
+  if (info.shmaddr == (char *)-1) {
+    shmctl(info.shmid, IPC_RMID, NULL);
+    return shm = false;
+  }
+  info.readOnly = True;
+
+  shm_failed = false;
+  auto old = XSetErrorHandler(shm_error_handler);
+  XShmAttach(display, &info);
+  XSync(display, False);
+  XSetErrorHandler(old);
+
+  // Marked for removal right away so the segment goes away with us.
+  shmctl(info.shmid, IPC_RMID, NULL);
+
+  if (shm_failed) {
+    shmdt(info.shmaddr);
+    info.shmaddr = NULL;
+    return shm = false;
+  }
+
+  capacity = bytes;
+  return true;
+}
+
+void Uploader::detach() {
+  if (capacity == 0)
+    return;
+
+  XShmDetach(display, &info);
+  XSync(display, False);
+  shmdt(info.shmaddr);
+  info.shmaddr = NULL;
+  capacity = 0;
+}
+
+Pixmap Uploader::upload_shm(poppler::image &img) {
+  int screen = DefaultScreen(display);
+  auto xim = XShmCreateImage(display, visual, depth, ZPixmap, NULL, &info,
+                             img.width(), img.height());
+  if (!xim)
+    return None;
+
+  if (!reserve(size_t(xim->bytes_per_line) * xim->height)) {
+    XDestroyImage(xim);
+    return None;
+  }
+  xim->data = info.shmaddr;
+
+  {
+    TraceSpan span("convert");
+    for (int y = 0; y < img.height(); ++y)
+      convert_pixels(format,
+                     (const uint32_t *)(img.const_data() +
+                                        y * img.bytes_per_row()),
+                     xim->data + y * xim->bytes_per_line, img.width());
+  }
+
+  Pixmap pxm = XCreatePixmap(display, DefaultRootWindow(display), img.width(),
+                             img.height(), depth);
+  XShmPutImage(display, pxm, DefaultGC(display, screen), xim, 0, 0, 0, 0,
+               img.width(), img.height(), False);
+
+  // The segment is reused for the next upload, wait until it has been read.
+  XSync(display, False);
+
+  xim->data = NULL;
+  XDestroyImage(xim);
+  return pxm;
+}
+
+// argb32 rows go out as they are, anything else is converted into a buffer
+// kept for the next upload.
+Pixmap Uploader::upload_put(poppler::image &img) {
+  int screen = DefaultScreen(display);
+  char *data = img.data();
+  int bytes_per_line = img.bytes_per_row();
+  if (!is_argb32(format)) {
+    TraceSpan span("convert");
+    bytes_per_line = get_bytes_per_line(format, img.width());
+    buf.resize(size_t(bytes_per_line) * img.height());
+    for (int y = 0; y < img.height(); ++y)
+      convert_pixels(format,
+                     (const uint32_t *)(img.const_data() +
+                                        y * img.bytes_per_row()),
+                     buf.data() + size_t(y) * bytes_per_line, img.width());
+    data = buf.data();
+  }
+
+  auto xim = XCreateImage(display, visual, depth, ZPixmap, 0, data,
+                          img.width(), img.height(), 32, bytes_per_line);
+
+  Pixmap pxm = XCreatePixmap(display, DefaultRootWindow(display), img.width(),
+                             img.height(), depth);
+
+  XPutImage(display, pxm, DefaultGC(display, screen), xim, 0, 0, 0, 0,
+            img.width(), img.height());
+
+  xim->data = NULL;
+  XDestroyImage(xim);
+  return pxm;
+}
@@ -0,0 +1,46 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include <vector>
+
+#include <poppler-image.h>
+
+#include "pixconv.hpp"
+
+// Turns rendered images into server side pixmaps. Uses a shared memory
+// segment when the server is local and supports MIT-SHM, XPutImage()
+// otherwise. Pixels are converted to the layout of the default visual on
+// the way.
+struct Uploader {
+  Uploader(Display *d);
+  ~Uploader();
+  Pixmap upload(poppler::image &img);
+  poppler::image download(Pixmap pxm, int w, int h);
+  bool using_shm() const;
+  double last_ms() const;
+  double average_ms() const;
+
+private:
+  bool reserve(size_t bytes);
+  void detach();
+  Pixmap upload_shm(poppler::image &img);
+  Pixmap upload_put(poppler::image &img);
+
+  Display *display;
+  Visual *visual;
+  int depth;
+  PixelFormat format;
+  std::vector<char> buf;
+  bool shm = false;
+  XShmSegmentInfo info{};
+  size_t capacity = 0;
+
+  double last = 0;
+  double total = 0;
+  unsigned count = 0;
+};
+
+#endif
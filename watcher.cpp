@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <poppler-page-renderer.h>
+#include <poppler-page.h>
+
+#include "textindex.hpp"
+#include "trace.hpp"
+#include "watcher.hpp"
+
+// Resolution of the render used to notice changes in pictures.
+static const double hash_dpi = 18;
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t n) {
+  auto p = (const unsigned char *)data;
+  for (size_t i = 0; i < n; ++i)
+    h = (h ^ p[i]) * 0x100000001b3;
+  return h;
+}
+
+static uint64_t hash_page(const poppler::page_renderer &r,
+                          const poppler::page *page) {
+  uint64_t h = 0xcbf29ce484222325;
+  auto rect = page->page_rect();
+  double geometry[] = {rect.x(), rect.y(), rect.width(), rect.height(),
+                       double(page->orientation())};
+  h = hash_bytes(h, geometry, sizeof(geometry));
+
+  auto text = extract_page_text(page);
+  h = hash_bytes(h, text.text.data(), text.text.size() * sizeof(char32_t));
+  h = hash_bytes(h, text.words.data(),
+                 text.words.size() * sizeof(PageText::Word));
+
+  auto img = r.render_page(page, hash_dpi, hash_dpi);
+  if (img.is_valid())
+    h = hash_bytes(h, img.const_data(), size_t(img.bytes_per_row()) *
+                                            img.height());
+  return h;
+}
+
+static std::vector<uint64_t> hash_pages(poppler::document &doc,
+                                        const std::atomic<bool> &stop) {
+  TraceSpan span("hash_pages");
+  poppler::page_renderer r;
+  std::vector<uint64_t> hashes;
+  for (int n = 0; n < doc.pages() && !stop; ++n) {
+    std::unique_ptr<poppler::page> page(doc.create_page(n));
+    hashes.push_back(page ? hash_page(r, page.get()) : 0);
+  }
+  return hashes;
+}
+
+Watcher::Watcher(std::function<std::shared_ptr<const DocumentData>()> r,
+                 std::shared_ptr<const DocumentData> dt, const std::string &f,
+                 bool watch, int d, std::function<void()> n)
+    : read_data(r), data(dt), file_name(f), delay_ms(d), notify(n) {
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+
+  // Editors and LaTeX often replace the file instead of writing to it, so
+  // the directory is watched for the name to come back.
+  if (watch)
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+  auto dir = std::filesystem::path(file_name).parent_path();
+  if (inotify_fd >= 0 &&
+      inotify_add_watch(inotify_fd, dir.empty() ? "." : dir.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+
+  if (wake_fd >= 0)
+    thread = std::thread(&Watcher::run, this);
+}
+
+Watcher::~Watcher() {
+  stop = true;
+  reload();
+  if (thread.joinable())
+    thread.join();
+  if (inotify_fd >= 0)
+    close(inotify_fd);
+  if (wake_fd >= 0)
+    close(wake_fd);
+}
+
+// Loads the file again now, whether it was written or not.
+void Watcher::reload() {
+  uint64_t one = 1;
+  if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+    perror("spdf: eventfd");
+}
+
+std::optional<Reloaded> Watcher::take() {
+  std::lock_guard lk(mtx);
+  auto r = std::move(result);
+  result.reset();
+  return r;
+}
+
+// Returns false when the watcher is stopping.
+bool Watcher::wait_for_change() {
+  auto name = std::filesystem::path(file_name).filename().string();
+  bool written = false;
+  while (!stop) {
+    pollfd fds[] = {{wake_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+    int n = poll(fds, inotify_fd >= 0 ? 2 : 1, written ? delay_ms : -1);
+    if (n == 0)
+      return true;
+    if (n < 0)
+      continue;
+
+    if (fds[0].revents & POLLIN) {
+      uint64_t count;
+      if (read(wake_fd, &count, sizeof(count)) < 0)
+        continue;
+      return !stop;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      alignas(inotify_event) char buf[4096];
+      ssize_t len = read(inotify_fd, buf, sizeof(buf));
+      for (ssize_t off = 0; off < len;) {
+        auto e = (const inotify_event *)(buf + off);
+        if (e->len > 0 && name == e->name)
+          written = true;
+        off += sizeof(inotify_event) + e->len;
+      }
+    }
+  }
+  return false;
+}
+
+void Watcher::run() {
+  auto hash_shown = [this]() {
+    auto doc = load_document(data);
+    return doc ? hash_pages(*doc, stop) : std::vector<uint64_t>{};
+  };
+
+  // A mapped file written in place shows the new version through the mapping,
+  // or faults past its new end, so it is hashed right away. The version shown
+  // is otherwise in memory and only hashed once a new one turns up.
+  std::optional<std::vector<uint64_t>> hashes;
+  if (data && data->map)
+    hashes = hash_shown();
+  while (wait_for_change()) {
+    // A file still being written fails to load, the next write retries.
+    auto next_data = read_data();
+    auto doc = load_document(next_data);
+    if (!doc || doc->pages() < 1)
+      continue;
+
+    if (!hashes)
+      hashes = hash_shown();
+    auto next = hash_pages(*doc, stop);
+    if (stop)
+      break;
+
+    auto &prev = *hashes;
+    std::vector<int> changed;
+    for (size_t i = 0; i < std::max(prev.size(), next.size()); ++i) {
+      if (i >= prev.size() || i >= next.size() || prev[i] != next[i])
+        changed.push_back(i + 1);
+    }
+    hashes = std::move(next);
+    data = next_data;
+    if (changed.empty())
+      continue;
+
+    {
+      // Versions that were never swapped in add up their changes.
+      std::lock_guard lk(mtx);
+      if (result) {
+        std::vector<int> merged;
+        std::set_union(result->changed.begin(), result->changed.end(),
+                       changed.begin(), changed.end(),
+                       std::back_inserter(merged));
+        changed = std::move(merged);
+      }
+      result = Reloaded{next_data, doc, std::move(changed)};
+    }
+    notify();
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poppler-document.h>
+
+#include "docdata.hpp"
+
+// A new version of the document and the pages (numbered from 1) that differ
+// from the previous one, including pages past the end of either version.
+struct Reloaded {
+  std::shared_ptr<const DocumentData> data;
+  std::shared_ptr<poppler::document> doc;
+  std::vector<int> changed;
+};
+
+// Loads new versions of the document on a background thread, when asked to
+// or, if watch is set, once writes to the file have stopped for delay_ms.
+// Pages are compared by hashing their geometry, text and a low resolution
+// render. The version shown, data, is only hashed once a new one turns up,
+// unless it is mapped from its file and may change along with it.
+struct Watcher {
+  Watcher(std::function<std::shared_ptr<const DocumentData>()> read_data,
+          std::shared_ptr<const DocumentData> data,
+          const std::string &file_name, bool watch, int delay_ms,
+          std::function<void()> notify);
+  ~Watcher();
+  void reload();
+  std::optional<Reloaded> take();
+
+private:
+  void run();
+  bool wait_for_change();
+
+  std::function<std::shared_ptr<const DocumentData>()> read_data;
+  std::shared_ptr<const DocumentData> data;
+  std::string file_name;
+  int delay_ms;
+  std::function<void()> notify;
+  int inotify_fd = -1;
+  int wake_fd = -1;
+
+  std::mutex mtx;
+  std::optional<Reloaded> result;
+
+  std::atomic<bool> stop{false};
+  std::thread thread;
+};
+
+#endif